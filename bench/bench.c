@@ -0,0 +1,468 @@
+/*
+ * Copyright (c) 2024 Manjeet Singh <itsmanjeet1998@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Benchmark suite, runs every workload RUNS times after a warm up and
+ * writes a JSON array with the median, min and max of each. Every value is
+ * a time, lower is better, so a baseline written by an earlier run is
+ * compared value by value and a workload slower by more than PERCENT is a
+ * regression.
+ *
+ *   capsule_bench [-r RUNS] [-o FILE] [-b BASELINE] [-t PERCENT] [-x CAPSULE] [NAME ...]
+ *
+ * NAMEs select workloads by prefix, CAPSULE is the interpreter started for
+ * the startup time. The exit status is 2 when a workload regressed.
+ */
+
+#include "../src/priv.h"
+#include "capsule.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef CAPSULE_BIN
+#    define CAPSULE_BIN "capsule"
+#endif
+
+#define MAX_RUNS 64
+#define MAX_RESULTS 32
+#define READER_SIZE (4 << 20)
+#define GC_LIVE 100000
+#define GC_GARBAGE 100000
+#define CALLS 10000
+
+static const char* PRELUDE = "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))\n"
+                             "(define (tak x y z) (if (not (< y x)) z (tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y))))\n"
+                             "(define (ack m n) (cond ((= m 0) (+ n 1)) ((= n 0) (ack (- m 1) 1)) (t (ack (- m 1) (ack m (- n 1))))))\n"
+                             "(define (queens-ok? row dist placed)\n"
+                             "  (if (null? placed) t\n"
+                             "      (if (= (car placed) (+ row dist)) nil\n"
+                             "          (if (= (car placed) (- row dist)) nil\n"
+                             "              (if (= (car placed) row) nil (queens-ok? row (+ dist 1) (cdr placed)))))))\n"
+                             "(define (queens-try x y z)\n"
+                             "  (if (null? x) (if (null? y) 1 0)\n"
+                             "      (+ (if (queens-ok? (car x) 1 z) (queens-try (append (cdr x) y) nil (cons (car x) z)) 0)\n"
+                             "         (queens-try (cdr x) (cons (car x) y) z))))\n"
+                             "(define (iota n acc) (if (= n 0) acc (iota (- n 1) (cons n acc))))\n"
+                             "(define (queens n) (queens-try (iota n nil) nil nil))\n"
+                             "(define (handler x y) (if (< x y) y x))\n";
+
+/* workloads evaluated in the scope the prelude was loaded in */
+static const struct {
+    const char* name;
+    const char* source;
+} EVALS[] = {
+    {"eval/fib", "(fib 20)"},
+    {"eval/tak", "(tak 18 12 6)"},
+    {"eval/ackermann", "(ack 2 9)"},
+    {"eval/nqueens", "(queens 7)"},
+    {"alloc/list-build", "(iota 10000 nil)"},
+    {"alloc/map-fold", "(foldl + 0 (map (lambda (x) (* x 2)) (iota 1000 nil)))"},
+};
+
+typedef struct {
+    char name[64];
+    const char* unit;
+    double value, min, max;
+    int runs;
+} Result;
+
+static Result results[MAX_RESULTS];
+static int results_count = 0;
+
+static int runs = 5;
+static char** selected = NULL;
+static int selected_count = 0;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static int selected_p(const char* name) {
+    if (selected_count == 0)
+        return 1;
+    for (int i = 0; i < selected_count; i++)
+        if (strncmp(name, selected[i], strlen(selected[i])) == 0)
+            return 1;
+    return 0;
+}
+
+static void record(const char* name, const char* unit, double* samples, int count) {
+    Result* r = &results[results_count++];
+
+    qsort(samples, count, sizeof(double), compare_double);
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->unit = unit;
+    r->runs = count;
+    r->min = samples[0];
+    r->max = samples[count - 1];
+    r->value = count % 2 ? samples[count / 2] : (samples[count / 2 - 1] + samples[count / 2]) / 2;
+    fprintf(stderr, "%-20s %10.4f %s  (min %.4f, max %.4f)\n", name, r->value, unit, r->min, r->max);
+}
+
+static int bench_eval(Capsule scope) {
+    double samples[MAX_RUNS];
+    CapsuleError error;
+    Capsule result;
+
+    for (size_t i = 0; i < sizeof(EVALS) / sizeof(EVALS[0]); i++) {
+        if (!selected_p(EVALS[i].name))
+            continue;
+        for (int run = -1; run < runs; run++) {
+            double start = now();
+            if ((error = Capsule_eval(EVALS[i].source, scope, &result))) {
+                fprintf(stderr, "ERROR: %s: %s\n", EVALS[i].name, Capsule_Error_str(error));
+                return 0;
+            }
+            if (run >= 0)
+                samples[run] = now() - start;
+        }
+        record(EVALS[i].name, "s", samples, runs);
+    }
+    return 1;
+}
+
+/* microseconds per call of HANDLER from C, through the call API and through source text */
+static int bench_call(Capsule scope) {
+    static Capsule argv[CALLS * 2], results[CALLS];
+    double apply[MAX_RUNS], batch[MAX_RUNS], source[MAX_RUNS];
+    CapsuleError error = CAPSULE_ERROR_NONE;
+    Capsule handler, result;
+    char text[64];
+
+    if (!selected_p("call"))
+        return 1;
+
+    Capsule_Scope_lookup(scope, CAPSULE_SYMBOL("HANDLER"), &handler);
+    for (int i = 0; i < CALLS; i++) {
+        argv[i * 2] = CAPSULE_INTEGER(i);
+        argv[i * 2 + 1] = CAPSULE_INTEGER(CALLS / 2);
+    }
+
+    for (int run = -1; run < runs && !error; run++) {
+        double start = now();
+        for (int i = 0; i < CALLS && !error; i++)
+            error = Capsule_apply(handler, 2, argv + i * 2, &result);
+        double middle = now();
+        if (!error)
+            error = Capsule_apply_batch(handler, CALLS, 2, argv, results);
+        double end = now();
+        for (int i = 0; i < CALLS && !error; i++) {
+            snprintf(text, sizeof(text), "(handler %d %d)", i, CALLS / 2);
+            error = Capsule_eval(text, scope, &result);
+        }
+        if (run >= 0) {
+            apply[run] = (middle - start) / CALLS * 1e6;
+            batch[run] = (end - middle) / CALLS * 1e6;
+            source[run] = (now() - end) / CALLS * 1e6;
+        }
+    }
+    if (error) {
+        fprintf(stderr, "ERROR: call: %s\n", Capsule_Error_str(error));
+        return 0;
+    }
+
+    record("call/apply", "us", apply, runs);
+    record("call/apply-batch", "us", batch, runs);
+    record("call/eval-source", "us", source, runs);
+    return 1;
+}
+
+/* READER_SIZE bytes of source shaped like the reader benchmark's records */
+static char* generate_source(size_t* size) {
+    static const char* WORDS[] = {"define", "lambda", "if", "let", "car", "cdr", "cons", "list-ref", "string-append", "make-vector"};
+    unsigned long seed = 42;
+    char* source = NULL;
+    FILE* out = open_memstream(&source, size);
+
+    for (unsigned long n = 0; ftell(out) < READER_SIZE; n++) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        unsigned r = seed >> 33;
+        fprintf(out,
+                ";; record %lu\n"
+                "(%s item-%lu\n"
+                "    (%s %u %u.%02u \"value %u with \\\"quotes\\\"\")\n"
+                "    '(%s nil %lu) [%u %u] {%s})\n",
+                n, WORDS[r % 10], n, WORDS[(r >> 4) % 10], r % 100000, r % 1000, r % 100, r, WORDS[(r >> 8) % 10], n, r & 0xFF,
+                (r >> 8) & 0xFF, WORDS[(r >> 12) % 10]);
+    }
+    fclose(out);
+    return source;
+}
+
+/* reads every form, and prints the forms read back to /dev/null */
+static int bench_reader_printer() {
+    static Capsule forms = {CAPSULE_TYPE_NIL};
+    double reading[MAX_RUNS], printing[MAX_RUNS];
+    CapsuleReader reader;
+    CapsuleError error;
+    Capsule form;
+    size_t size;
+
+    if (!selected_p("reader") && !selected_p("printer"))
+        return 1;
+
+    char* source = generate_source(&size);
+    FILE* out = fopen("/dev/null", "w");
+    gc_protect(&forms);
+
+    for (int run = -1; run < runs; run++) {
+        forms = Capsule_nil;
+        Capsule_Reader_init_buffer(&reader, source);
+        double start = now();
+        while ((error = Capsule_Reader_next(&reader, &form)) == CAPSULE_ERROR_NONE) {
+            forms = CAPSULE_CONS(form, forms);
+            gc_maybe();
+        }
+        double read = now() - start;
+        if (error != CAPSULE_ERROR_EOF) {
+            fprintf(stderr, "ERROR: reader: %s\n", Capsule_Error_str(error));
+            free(source);
+            return 0;
+        }
+
+        start = now();
+        Capsule_print(forms, out);
+        fflush(out);
+        if (run >= 0) {
+            reading[run] = read;
+            printing[run] = now() - start;
+        }
+    }
+    forms = Capsule_nil;
+    fclose(out);
+    free(source);
+
+    if (selected_p("reader"))
+        record("reader", "s", reading, runs);
+    if (selected_p("printer"))
+        record("printer", "s", printing, runs);
+    return 1;
+}
+
+/* pauses of full collections with GC_LIVE pairs reachable and GC_GARBAGE dropped between them */
+static int bench_gc() {
+    static Capsule live = {CAPSULE_TYPE_NIL};
+    double pauses[MAX_RUNS * 4];
+    int count = runs * 4;
+
+    if (!selected_p("gc"))
+        return 1;
+
+    gc_protect(&live);
+    for (int i = 0; i < GC_LIVE; i++)
+        live = CAPSULE_CONS(CAPSULE_INTEGER(i), live);
+
+    for (int i = -1; i < count; i++) {
+        for (int j = 0; j < GC_GARBAGE; j++)
+            (void)CAPSULE_CONS(CAPSULE_INTEGER(j), Capsule_nil);
+        double start = now();
+        gc();
+        if (i >= 0)
+            pauses[i] = (now() - start) * 1e3;
+    }
+    live = Capsule_nil;
+    gc();
+
+    /* the distribution is kept as percentiles, each compared on its own */
+    qsort(pauses, count, sizeof(double), compare_double);
+    double p50[1] = {pauses[count / 2]}, p90[1] = {pauses[count * 9 / 10]}, worst[1] = {pauses[count - 1]};
+    record("gc/pause-p50", "ms", p50, 1);
+    record("gc/pause-p90", "ms", p90, 1);
+    record("gc/pause-max", "ms", worst, 1);
+    return 1;
+}
+
+/* the interpreter started on an empty script, loading the runtime and exiting */
+static int bench_startup(const char* capsule) {
+    double samples[MAX_RUNS];
+    char script[] = "/tmp/capsule-bench-XXXXXX", cache[sizeof(script) + 8];
+    int fd, status, ok = 1;
+    pid_t pid;
+
+    if (!selected_p("startup"))
+        return 1;
+    if ((fd = mkstemp(script)) < 0) {
+        perror(script);
+        return 0;
+    }
+    close(fd);
+    snprintf(cache, sizeof(cache), "%s.capc", script);
+
+    char* argv[] = {(char*)capsule, script, NULL};
+    for (int run = -1; ok && run < runs; run++) {
+        double start = now();
+        if ((pid = fork()) == 0) {
+            execvp(capsule, argv);
+            _exit(127);
+        }
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || status != 0) {
+            fprintf(stderr, "ERROR: startup: failed to run %s\n", capsule);
+            ok = 0;
+        } else if (run >= 0) {
+            samples[run] = now() - start;
+        }
+    }
+    unlink(script);
+    unlink(cache);
+
+    if (ok)
+        record("startup", "s", samples, runs);
+    return ok;
+}
+
+static int write_results(const char* path) {
+    Capsule list = Capsule_nil;
+    FILE* out = path ? fopen(path, "w") : stdout;
+
+    if (out == NULL) {
+        perror(path);
+        return 0;
+    }
+
+    for (int i = results_count - 1; i >= 0; i--) {
+        Result* r = &results[i];
+        Capsule entry = CAPSULE_CONS(CAPSULE_CONS(CAPSULE_STRING("runs"), CAPSULE_INTEGER(r->runs)), Capsule_nil);
+        entry = CAPSULE_CONS(CAPSULE_CONS(CAPSULE_STRING("max"), CAPSULE_DECIMAL(r->max)), entry);
+        entry = CAPSULE_CONS(CAPSULE_CONS(CAPSULE_STRING("min"), CAPSULE_DECIMAL(r->min)), entry);
+        entry = CAPSULE_CONS(CAPSULE_CONS(CAPSULE_STRING("unit"), CAPSULE_STRING(r->unit)), entry);
+        entry = CAPSULE_CONS(CAPSULE_CONS(CAPSULE_STRING("value"), CAPSULE_DECIMAL(r->value)), entry);
+        entry = CAPSULE_CONS(CAPSULE_CONS(CAPSULE_STRING("name"), CAPSULE_STRING(r->name)), entry);
+        list = CAPSULE_CONS(entry, list);
+    }
+
+    CapsuleError error = json_write(out, list);
+    fputc('\n', out);
+    if (out != stdout)
+        fclose(out);
+    return error == CAPSULE_ERROR_NONE;
+}
+
+static Capsule field(Capsule object, const char* key) {
+    for (; object.type == CAPSULE_TYPE_PAIR; object = CAPSULE_CDR(object)) {
+        Capsule entry = CAPSULE_CAR(object);
+        if (entry.type == CAPSULE_TYPE_PAIR && CAPSULE_STRINGP(CAPSULE_CAR(entry)) &&
+            strcmp(CAPSULE_AS_STRING(CAPSULE_CAR(entry)), key) == 0)
+            return CAPSULE_CDR(entry);
+    }
+    return Capsule_nil;
+}
+
+/* the number of workloads slower than in BASELINE by more than PERCENT, -1 when it can't be read */
+static int compare(const char* path, double percent) {
+    Capsule baseline;
+    FILE* in = fopen(path, "r");
+    int regressions = 0;
+
+    if (in == NULL) {
+        perror(path);
+        return -1;
+    }
+    CapsuleError error = json_read(in, &baseline);
+    fclose(in);
+    if (error) {
+        fprintf(stderr, "ERROR: %s: %s\n", path, Capsule_Error_str(error));
+        return -1;
+    }
+
+    fprintf(stderr, "\n%-20s %10s %10s %8s\n", "compared to", "baseline", "current", "change");
+    for (int i = 0; i < results_count; i++) {
+        Capsule old = Capsule_nil;
+        for (Capsule b = baseline; b.type == CAPSULE_TYPE_PAIR; b = CAPSULE_CDR(b)) {
+            Capsule name = field(CAPSULE_CAR(b), "name");
+            if (CAPSULE_STRINGP(name) && strcmp(CAPSULE_AS_STRING(name), results[i].name) == 0)
+                old = field(CAPSULE_CAR(b), "value");
+        }
+        if (!CAPSULE_DECIMALP(old) && !CAPSULE_INTEGERP(old))
+            continue;
+
+        double before = CAPSULE_DECIMALP(old) ? CAPSULE_AS_DECIMAL(old) : (double)CAPSULE_AS_INTEGER(old);
+        double change = before > 0 ? (results[i].value - before) / before * 100 : 0;
+        int regressed = change > percent;
+        regressions += regressed;
+        fprintf(stderr, "%-20s %10.4f %10.4f %+7.1f%%%s\n", results[i].name, before, results[i].value, change,
+                regressed ? "  REGRESSION" : "");
+    }
+    return regressions;
+}
+
+int main(int argc, char** argv) {
+    const char *output = NULL, *baseline = NULL, *capsule = CAPSULE_BIN;
+    double percent = 10;
+    Capsule scope, result;
+    CapsuleError error;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:o:b:t:x:")) != -1) {
+        switch (opt) {
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'b':
+            baseline = optarg;
+            break;
+        case 't':
+            percent = atof(optarg);
+            break;
+        case 'x':
+            capsule = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r RUNS] [-o FILE] [-b BASELINE] [-t PERCENT] [-x CAPSULE] [NAME ...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (runs < 1 || runs > MAX_RUNS) {
+        fprintf(stderr, "ERROR: RUNS must be between 1 and %d\n", MAX_RUNS);
+        return 1;
+    }
+    selected = argv + optind;
+    selected_count = argc - optind;
+
+    scope = Capsule_Scope_global();
+    if ((error = Capsule_eval(PRELUDE, scope, &result))) {
+        fprintf(stderr, "ERROR: prelude: %s\n", Capsule_Error_str(error));
+        return 1;
+    }
+
+    if (!bench_eval(scope) || !bench_call(scope) || !bench_reader_printer() || !bench_gc() || !bench_startup(capsule) ||
+        !write_results(output))
+        return 1;
+
+    if (baseline) {
+        int regressions = compare(baseline, percent);
+        if (regressions < 0)
+            return 1;
+        if (regressions > 0) {
+            fprintf(stderr, "%d workload%s regressed by more than %.0f%%\n", regressions, regressions == 1 ? "" : "s", percent);
+            return 2;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2024 Manjeet Singh <itsmanjeet1998@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * CSV and JSON throughput, reads generated files record by record and
+ * writes the records back out, reporting MB/s for each.
+ *
+ *   capsule_bench_data [-s SIZE_MB] [DIRECTORY]
+ *
+ * The data files (SIZE_MB each, default 100) are generated in DIRECTORY,
+ * the current directory by default, and removed afterwards.
+ */
+
+#include "../src/priv.h"
+#include "capsule.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int generate(const char* path, size_t target, int json) {
+    FILE* out = fopen(path, "w");
+    if (out == NULL)
+        return 0;
+
+    size_t written = 0;
+    if (json)
+        written += fprintf(out, "[\n");
+    for (unsigned long n = 0; written < target; n++) {
+        int count = json ? fprintf(out,
+                                   "%s{\"id\": %lu, \"name\": \"user %lu\", \"score\": %lu.%02lu, \"active\": %s, "
+                                   "\"tags\": [\"alpha\", \"beta\", \"with \\\"quotes\\\"\"], \"parent\": null}",
+                                   n ? ",\n" : "", n, n, n % 1000, n % 100, n % 2 ? "true" : "false")
+                         : fprintf(out, "%lu,user %lu,%lu.%02lu,\"city, state\",\"said \"\"hi\"\"\",plain text field\n", n, n,
+                                   n % 1000, n % 100);
+        if (count < 0)
+            break;
+        written += count;
+    }
+    if (json)
+        fprintf(out, "\n]\n");
+
+    return fclose(out) == 0 && written >= target;
+}
+
+static int run(const char* name, const char* path, int json) {
+    struct stat st;
+    JsonStream stream;
+    CapsuleError error;
+    Capsule record;
+    size_t records = 0;
+
+    FILE* in = fopen(path, "r");
+    FILE* out = fopen("/dev/null", "w");
+    if (in == NULL || out == NULL || stat(path, &st) != 0) {
+        fprintf(stderr, "ERROR: failed to open '%s'\n", path);
+        return 0;
+    }
+
+    json_stream_init(&stream, in);
+    double start = now(), elapsed, writing = 0;
+    while (!(error = json ? json_stream_next(&stream, &record) : csv_read(in, &record))) {
+        double begin = now();
+        error = json ? json_write(out, record) : csv_write(out, record);
+        writing += now() - begin;
+        if (error)
+            break;
+        records++;
+        gc_maybe();
+    }
+    elapsed = now() - start - writing;
+    fclose(in);
+    fclose(out);
+
+    if (error != CAPSULE_ERROR_EOF) {
+        fprintf(stderr, "ERROR: %s: %s after %zu records\n", name, Capsule_Error_str(error), records);
+        return 0;
+    }
+
+    printf("%s: %zu records, read %.1f MB/s, write %.1f MB/s\n", name, records, st.st_size / elapsed / (1 << 20),
+           st.st_size / writing / (1 << 20));
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    size_t target = 100;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        if (opt != 's') {
+            fprintf(stderr, "usage: %s [-s SIZE_MB] [DIRECTORY]\n", argv[0]);
+            return 1;
+        }
+        target = strtoul(optarg, NULL, 10);
+    }
+    const char* directory = optind < argc ? argv[optind] : ".";
+
+    char csv[4096], json[4096];
+    snprintf(csv, sizeof(csv), "%s/capsule-bench.csv", directory);
+    snprintf(json, sizeof(json), "%s/capsule-bench.json", directory);
+
+    int ok = generate(csv, target << 20, 0) && generate(json, target << 20, 1);
+    ok = ok && run("csv", csv, 0) && run("json", json, 1);
+
+    unlink(csv);
+    unlink(json);
+    return ok ? 0 : 1;
+}
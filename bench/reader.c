@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2024 Manjeet Singh <itsmanjeet1998@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Reader throughput, reads every form of a data file and reports MB/s.
+ *
+ *   capsule_bench_reader [-s SIZE_MB] [-k] FILE
+ *
+ * FILE is generated with SIZE_MB (default 16) of S-expression data unless
+ * it already exists, -k keeps a generated file around for the next run.
+ *
+ * The number covers building the forms as well as scanning the text. Most
+ * of the time goes to allocating a cons per list element, so the vector
+ * scanner barely moves it, a faster scanner shows in lexing alone.
+ */
+
+#include "../src/priv.h"
+#include "capsule.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char* WORDS[] = {"define", "lambda", "if", "let", "car", "cdr", "cons", "list-ref", "string-append", "make-vector"};
+
+static int generate(const char* path, size_t target) {
+    FILE* out = fopen(path, "w");
+    if (out == NULL)
+        return 0;
+
+    size_t written = 0;
+    unsigned long seed = 42;
+    for (unsigned long n = 0; written < target; n++) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        unsigned r = seed >> 33;
+        int count = fprintf(out,
+                            ";; record %lu\n"
+                            "(%s item-%lu\n"
+                            "    (%s %u %u.%02u \"value %u with \\\"quotes\\\"\")\n"
+                            "    '(%s nil %lu) [%u %u] {%s})\n",
+                            n, WORDS[r % 10], n, WORDS[(r >> 4) % 10], r % 100000, r % 1000, r % 100, r, WORDS[(r >> 8) % 10], n,
+                            r & 0xFF, (r >> 8) & 0xFF, WORDS[(r >> 12) % 10]);
+        if (count < 0)
+            break;
+        written += count;
+    }
+
+    return fclose(out) == 0 && written >= target;
+}
+
+/* keeps the page walk from being optimised away */
+static volatile unsigned long sink;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+    size_t target = 16;
+    int keep = 0, opt, generated = 0;
+
+    while ((opt = getopt(argc, argv, "s:k")) != -1) {
+        switch (opt) {
+        case 's':
+            target = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s SIZE_MB] [-k] FILE\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-s SIZE_MB] [-k] FILE\n", argv[0]);
+        return 1;
+    }
+    const char* path = argv[optind];
+
+    if (access(path, R_OK) != 0) {
+        fprintf(stderr, "generating %zu MB of data in %s\n", target, path);
+        if (!generate(path, target << 20)) {
+            fprintf(stderr, "ERROR: failed to generate '%s'\n", path);
+            return 1;
+        }
+        generated = 1;
+    }
+
+    size_t size, length;
+    char* source = map_file(path, 0, &size, &length);
+    if (source == NULL) {
+        fprintf(stderr, "ERROR: failed to map '%s'\n", path);
+        return 1;
+    }
+
+    /* fault the file in so the timing covers the reader and not the disk */
+    unsigned long sum = 0;
+    for (size_t i = 0; i < size; i += 4096)
+        sum += source[i];
+    sink = sum;
+
+    CapsuleReader reader;
+    CapsuleError error;
+    Capsule form;
+    size_t forms = 0;
+
+    Capsule_Reader_init_buffer(&reader, source);
+    double start = now();
+    while ((error = Capsule_Reader_next(&reader, &form)) == CAPSULE_ERROR_NONE) {
+        forms++;
+        gc_maybe();
+    }
+    double elapsed = now() - start;
+
+    unmap_file(source, length);
+    if (generated && !keep)
+        unlink(path);
+
+    if (error != CAPSULE_ERROR_EOF) {
+        fprintf(stderr, "ERROR: %s after %zu forms\n", Capsule_Error_str(error), forms);
+        return 1;
+    }
+
+    printf("%zu bytes, %zu forms in %.3fs, %.1f MB/s\n", size, forms, elapsed, size / elapsed / (1 << 20));
+    fprintf(stderr, "note: includes allocating the forms, which dominates over scanning\n");
+    return 0;
+}
@@ -20,6 +20,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #ifdef HAS_READLINE
@@ -59,9 +60,21 @@ static int is_complete(const char* source) {
     return count[0] == count[1] == count[2] == 0;
 }
 
+static int dump(const char* path, Capsule scope) {
+    CapsuleError error;
+    if ((error = Capsule_Image_dump(path, scope))) {
+        fprintf(stderr, "ERROR: failed to dump image '%s': %s\n", path, Capsule_Error_str(error));
+        return 1;
+    }
+    return 0;
+}
+
 int main(int argc, char** argv) {
-    Capsule scope = Capsule_Scope_global();
+    Capsule scope;
     const char* filename = NULL;
+    const char* image = NULL;
+    const char* dump_image = NULL;
+    const char* profile = NULL;
     char* source = NULL;
     int interactive = 0;
     CapsuleError error = CAPSULE_ERROR_NONE;
@@ -70,7 +83,13 @@ int main(int argc, char** argv) {
     Capsule args_i = args;
 
     for (int i = 1; i < argc; i++) {
-        if (argv[i][0] == '-') {
+        if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            image = argv[++i];
+        } else if (strcmp(argv[i], "--dump-image") == 0 && i + 1 < argc) {
+            dump_image = argv[++i];
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile = argv[++i];
+        } else if (argv[i][0] == '-') {
             fprintf(stderr, "ERROR: invalid flag '%s'\n", argv[i]);
             return 1;
         } else if (filename == NULL && access(argv[i], F_OK) == 0) {
@@ -85,14 +104,37 @@ int main(int argc, char** argv) {
         }
     }
 
+    if (image) {
+        if ((error = Capsule_Image_load(image, &scope))) {
+            fprintf(stderr, "ERROR: failed to load image '%s': %s\n", image, Capsule_Error_str(error));
+            return 1;
+        }
+    } else {
+        scope = Capsule_Scope_global();
+    }
+
     Capsule_Scope_define(scope, CAPSULE_SYMBOL("ARGS"), args);
 
+    /* the folded stacks are written when the program exits */
+    if (profile && profile_start(profile, scope))
+        return 1;
+
     if (filename) {
-        source = slurp(filename);
-        if (source == NULL) {
+        /* the script is read as it is evaluated, a missing one is reported before anything runs */
+        FILE* file = fopen(filename, "rb");
+        if (file == NULL) {
             fprintf(stderr, "ERROR: failed to read '%s': %s\n", filename, strerror(errno));
             return 1;
         }
+        fclose(file);
+
+        if ((error = Capsule_load(filename, scope, &result))) {
+            fprintf(stderr, "ERROR: %s\n", Capsule_Error_str(error));
+            return 1;
+        }
+        return dump_image ? dump(dump_image, scope) : 0;
+    } else if (dump_image) {
+        return dump(dump_image, scope);
     } else {
         printf("%s\n"
                "Capsule Programming Language\n"
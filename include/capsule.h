@@ -26,12 +26,16 @@ typedef enum {
     CAPSULE_ERROR_ARGS,
     CAPSULE_ERROR_TYPE,
     CAPSULE_ERROR_RUNTIME,
+    CAPSULE_ERROR_EOF,
 } CapsuleError;
 
 struct Capsule;
 
 typedef CapsuleError (*CapsuleBuiltin)(struct Capsule args, struct Capsule scope, struct Capsule* result);
 
+/* entry point of a native module <id>, exported as Capsule_<id>_init and called with the module's scope */
+typedef CapsuleError (*CapsuleModuleInit)(struct Capsule scope);
+
 typedef enum {
     CAPSULE_TYPE_NIL,
     CAPSULE_TYPE_PAIR,
@@ -64,6 +68,54 @@ struct CapsulePair {
 
 typedef struct Capsule Capsule;
 
+/* special forms the evaluator dispatches on, counted by kind in CapsuleStats */
+typedef enum {
+    CAPSULE_FORM_QUOTE,
+    CAPSULE_FORM_DEFINE,
+    CAPSULE_FORM_LAMBDA,
+    CAPSULE_FORM_BEGIN,
+    CAPSULE_FORM_IF,
+    CAPSULE_FORM_DEFMACRO,
+    CAPSULE_FORM_APPLY,
+    CAPSULE_FORM_SET,
+    CAPSULE_FORM_COUNT,
+} CapsuleForm;
+
+/*
+ * Evaluator counters since startup or the last reset, kept when built with
+ * EVAL_STATS. There is one set per process, like the heap, the global scope
+ * and the scheduler they count, so no interpreter context is threaded
+ * through the evaluator to hold them. The cost is that the counts can not
+ * be split per interpreter, every evaluation in the process adds to them.
+ */
+typedef struct {
+    size_t steps;
+    size_t forms[CAPSULE_FORM_COUNT];
+    size_t closure_calls;
+    size_t builtin_calls;
+    size_t macro_expansions;
+    size_t lookups;
+    size_t lookup_scopes;   /* scopes searched by all lookups, over lookups it is the mean chain length */
+    size_t lookup_bindings; /* bindings compared by all lookups */
+} CapsuleStats;
+
+typedef enum {
+    CAPSULE_TRACE_APPLY,  /* value is the argument list */
+    CAPSULE_TRACE_RETURN, /* value is the result */
+} CapsuleTraceEvent;
+
+/* called with the closure or builtin applied and when it returns, frames a continuation escapes from never return */
+typedef void (*CapsuleTraceHook)(CapsuleTraceEvent event, struct Capsule fn, struct Capsule value, void* data);
+
+typedef struct {
+    FILE* file;
+    char* buffer;
+    const char* source;
+    size_t position;
+    size_t size;
+    size_t capacity;
+} CapsuleReader;
+
 #define CAPSULE_CAR(cap) ((cap).as.pair->pellete[0])
 #define CAPSULE_CDR(cap) ((cap).as.pair->pellete[1])
 
@@ -98,14 +150,48 @@ static const Capsule Capsule_nil = {CAPSULE_TYPE_NIL};
 
 CapsuleError Capsule_read(const char* source, Capsule* result);
 
+void Capsule_Reader_init_file(CapsuleReader* reader, FILE* file);
+
+void Capsule_Reader_init_buffer(CapsuleReader* reader, const char* source);
+
+CapsuleError Capsule_Reader_next(CapsuleReader* reader, Capsule* result);
+
+void Capsule_Reader_close(CapsuleReader* reader);
+
+CapsuleError Capsule_load(const char* path, Capsule scope, Capsule* result);
+
 void Capsule_print(Capsule atom, FILE* out);
 
+/* like snprintf, writes at most size - 1 bytes and returns the full length */
+size_t Capsule_print_to_buffer(Capsule atom, char* buffer, size_t size);
+
 const char* Capsule_logo();
 
 CapsuleError Capsule_eval_cap(Capsule expr, Capsule scope, Capsule* result);
 
 CapsuleError Capsule_eval(const char* source, Capsule scope, Capsule* result);
 
+/*
+ * Calls the closure or builtin FN with ARGC values, without building or
+ * evaluating a call expression. Like Capsule_eval there is no interpreter
+ * argument, the call runs on the process's one heap and nests in whatever
+ * evaluation is running on this thread. Two interpreters can not share a
+ * process, so a callback can not re-enter a different one.
+ */
+CapsuleError Capsule_apply(Capsule fn, size_t argc, const Capsule* argv, Capsule* result);
+
+/* FN over COUNT tuples of ARGC values packed in ARGV until an error, ARGV and the results are rooted meanwhile */
+CapsuleError Capsule_apply_batch(Capsule fn, size_t count, size_t argc, const Capsule* argv, Capsule* results);
+
+/* CAPSULE_ERROR_RUNTIME without EVAL_STATS, the counters are then not kept */
+CapsuleError Capsule_stats(CapsuleStats* stats);
+
+void Capsule_stats_reset();
+
+/* HOOK is called on every apply and return until replaced, NULL removes it */
+CapsuleError Capsule_trace(CapsuleTraceHook hook, void* data);
+
+/* POINTER released with DELLOCATE once unreachable, a pointer already managed is returned as it is */
 Capsule Capsule_managed_pointer(void* pointer, void (*dellocate)(void*));
 
 int Capsule_compare(Capsule a, Capsule b);
@@ -116,6 +202,10 @@ Capsule Capsule_Scope_new(Capsule parent);
 
 Capsule Capsule_Scope_global();
 
+CapsuleError Capsule_Image_dump(const char* path, Capsule scope);
+
+CapsuleError Capsule_Image_load(const char* path, Capsule* scope);
+
 int Capsule_Scope_define(Capsule env, Capsule symbol, Capsule value);
 
 int Capsule_Scope_lookup(Capsule env, Capsule symbol, Capsule* result);
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2024 Manjeet Singh <itsmanjeet1998@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * libm as a native module, (import 'math) binds SQRT, EXP, POW ... in the
+ * calling scope. Integer arguments are taken as decimals.
+ */
+
+#include <capsule.h>
+#include <math.h>
+
+static CapsuleError decimal_arg(Capsule arg, double* x) {
+    if (CAPSULE_DECIMALP(arg))
+        *x = CAPSULE_AS_DECIMAL(arg);
+    else if (CAPSULE_INTEGERP(arg))
+        *x = (double)CAPSULE_AS_INTEGER(arg);
+    else
+        return CAPSULE_ERROR_TYPE;
+    return CAPSULE_ERROR_NONE;
+}
+
+static CapsuleError unary(double (*fn)(double), Capsule args, Capsule* result) {
+    CapsuleError error;
+    double x;
+
+    if (CAPSULE_NILP(args) || !CAPSULE_NILP(CAPSULE_CDR(args)))
+        return CAPSULE_ERROR_ARGS;
+    if ((error = decimal_arg(CAPSULE_CAR(args), &x)))
+        return error;
+
+    *result = CAPSULE_DECIMAL(fn(x));
+    return CAPSULE_ERROR_NONE;
+}
+
+static CapsuleError binary(double (*fn)(double, double), Capsule args, Capsule* result) {
+    CapsuleError error;
+    double x, y;
+
+    if (CAPSULE_NILP(args) || CAPSULE_NILP(CAPSULE_CDR(args)) || !CAPSULE_NILP(CAPSULE_CDR(CAPSULE_CDR(args))))
+        return CAPSULE_ERROR_ARGS;
+    if ((error = decimal_arg(CAPSULE_CAR(args), &x)) || (error = decimal_arg(CAPSULE_CAR(CAPSULE_CDR(args)), &y)))
+        return error;
+
+    *result = CAPSULE_DECIMAL(fn(x, y));
+    return CAPSULE_ERROR_NONE;
+}
+
+#define UNARY(id, fn)                                                                                                             \
+    static CapsuleError math_##id(Capsule args, Capsule scope, Capsule* result) {                                                 \
+        (void)scope;                                                                                                              \
+        return unary(fn, args, result);                                                                                           \
+    }
+
+#define BINARY(id, fn)                                                                                                            \
+    static CapsuleError math_##id(Capsule args, Capsule scope, Capsule* result) {                                                 \
+        (void)scope;                                                                                                              \
+        return binary(fn, args, result);                                                                                          \
+    }
+
+UNARY(sqrt, sqrt)
+UNARY(exp, exp)
+UNARY(log, log)
+UNARY(sin, sin)
+UNARY(cos, cos)
+UNARY(tan, tan)
+UNARY(floor, floor)
+UNARY(ceil, ceil)
+UNARY(fabs, fabs)
+BINARY(pow, pow)
+BINARY(atan2, atan2)
+BINARY(fmod, fmod)
+
+static const struct {
+    const char* symbol;
+    CapsuleBuiltin builtin;
+} MATH_BUILTINS[] = {
+    {"SQRT", math_sqrt},
+    {"EXP", math_exp},
+    {"LOG", math_log},
+    {"SIN", math_sin},
+    {"COS", math_cos},
+    {"TAN", math_tan},
+    {"FLOOR", math_floor},
+    {"CEIL", math_ceil},
+    {"FABS", math_fabs},
+    {"POW", math_pow},
+    {"ATAN2", math_atan2},
+    {"FMOD", math_fmod},
+};
+
+CapsuleError Capsule_math_init(Capsule scope) {
+    for (size_t i = 0; i < sizeof(MATH_BUILTINS) / sizeof(MATH_BUILTINS[0]); i++)
+        Capsule_Scope_define(scope, CAPSULE_SYMBOL(MATH_BUILTINS[i].symbol), CAPSULE_BUILTIN(MATH_BUILTINS[i].builtin));
+
+    Capsule_Scope_define(scope, CAPSULE_SYMBOL("PI"), CAPSULE_DECIMAL(M_PI));
+    return CAPSULE_ERROR_NONE;
+}
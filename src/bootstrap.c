@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2024 Manjeet Singh <itsmanjeet1998@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Build time helper, evaluates runtime.cap and writes the runtime scope as an
+ * image embedded in a C header so capsule_Shared never parses it at startup.
+ */
+
+#include "priv.h"
+#include <stdlib.h>
+
+int main(int argc, char** argv) {
+    CapsuleError error;
+    char* image = NULL;
+    size_t size = 0;
+    FILE* out;
+
+    if (argc != 3) {
+        fprintf(stderr, "ERROR: %s <ID> <TARGET>\n", argv[0]);
+        return 1;
+    }
+
+    /* the global scope is a child of the frozen runtime scope */
+    Capsule runtime = CAPSULE_CAR(Capsule_Scope_global());
+
+    out = open_memstream(&image, &size);
+    if (out == NULL || (error = image_write(out, runtime)) || fclose(out) != 0) {
+        fprintf(stderr, "ERROR: failed to write runtime image\n");
+        return 1;
+    }
+
+    out = fopen(argv[2], "w");
+    if (out == NULL) {
+        fprintf(stderr, "ERROR: failed to open '%s'\n", argv[2]);
+        return 1;
+    }
+
+    fprintf(out,
+            "#ifndef CAPSULE_RUNTIME_IMAGE_H\n"
+            "#define CAPSULE_RUNTIME_IMAGE_H\n\n"
+            "static unsigned char %s[] __attribute__((aligned(16))) = {",
+            argv[1]);
+    for (size_t i = 0; i < size; i++) {
+        fprintf(out, "%s0x%02x,", i % 16 ? " " : "\n    ", (unsigned char)image[i]);
+    }
+    fprintf(out, "\n};\n\n#endif\n");
+
+    free(image);
+    return fclose(out) == 0 ? 0 : 1;
+}
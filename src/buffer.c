@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2024 Manjeet Singh <itsmanjeet1998@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Byte buffers
+ *
+ * A buffer is malloc'd memory owned by the collector through a managed
+ * pointer. The value is the address of the first byte so it is handed to
+ * foreign code as a :PTR argument without copying, the size is kept in a
+ * header in front of it. Elements are read and written at byte offsets
+ * through a view type, a struct layout gives each field of a C struct its
+ * view and offset.
+ */
+
+#include "priv.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef union {
+    size_t size;
+    max_align_t align;
+} BufferHeader;
+
+static void buffer_free(void* data) {
+    free((BufferHeader*)data - 1);
+}
+
+CapsuleError buffer_new(size_t size, Capsule* result) {
+    BufferHeader* header = calloc(1, sizeof(BufferHeader) + size);
+    if (header == NULL)
+        return CAPSULE_ERROR_RUNTIME;
+
+    header->size = size;
+    *result = Capsule_managed_pointer(header + 1, buffer_free);
+    return CAPSULE_ERROR_NONE;
+}
+
+int buffer_data(Capsule buffer, unsigned char** data, size_t* size) {
+    if (!managed_pointerp(buffer, buffer_free))
+        return 0;
+
+    *data = buffer.as.pointer;
+    *size = ((BufferHeader*)buffer.as.pointer - 1)->size;
+    return 1;
+}
+
+size_t buffer_view_size(long view) {
+    switch (view) {
+    case BUFFER_U8:
+    case BUFFER_I8:
+        return 1;
+    case BUFFER_U16:
+    case BUFFER_I16:
+        return 2;
+    case BUFFER_U32:
+    case BUFFER_I32:
+    case BUFFER_F32:
+        return 4;
+    case BUFFER_U64:
+    case BUFFER_I64:
+    case BUFFER_F64:
+        return 8;
+    case CAPSULE_TYPE_POINTER:
+        return sizeof(void*);
+    default:
+        return 0;
+    }
+}
+
+/* the element at OFFSET checked against the buffer, elements are copied so it may be unaligned */
+static CapsuleError buffer_element(Capsule buffer, long view, long offset, unsigned char** element) {
+    unsigned char* data;
+    size_t size, width = buffer_view_size(view);
+
+    if (!buffer_data(buffer, &data, &size) || width == 0)
+        return CAPSULE_ERROR_TYPE;
+    if (offset < 0 || (size_t)offset > size || size - offset < width)
+        return CAPSULE_ERROR_ARGS;
+
+    *element = data + offset;
+    return CAPSULE_ERROR_NONE;
+}
+
+#define VIEW_GET(ctype, make)                                                                                                     \
+    do {                                                                                                                          \
+        ctype value;                                                                                                              \
+        memcpy(&value, element, sizeof(value));                                                                                   \
+        *result = make(value);                                                                                                    \
+    } while (0)
+
+/* the value of type VIEW stored at ELEMENT, also used for foreign arguments and results */
+CapsuleError view_load(long view, const void* element, Capsule* result) {
+    switch (view) {
+    case BUFFER_U8:
+        VIEW_GET(uint8_t, CAPSULE_INTEGER);
+        break;
+    case BUFFER_I8:
+        VIEW_GET(int8_t, CAPSULE_INTEGER);
+        break;
+    case BUFFER_U16:
+        VIEW_GET(uint16_t, CAPSULE_INTEGER);
+        break;
+    case BUFFER_I16:
+        VIEW_GET(int16_t, CAPSULE_INTEGER);
+        break;
+    case BUFFER_U32:
+        VIEW_GET(uint32_t, CAPSULE_INTEGER);
+        break;
+    case BUFFER_I32:
+        VIEW_GET(int32_t, CAPSULE_INTEGER);
+        break;
+    case BUFFER_U64:
+        VIEW_GET(uint64_t, CAPSULE_INTEGER);
+        break;
+    case BUFFER_I64:
+        VIEW_GET(int64_t, CAPSULE_INTEGER);
+        break;
+    case BUFFER_F32:
+        VIEW_GET(float, CAPSULE_DECIMAL);
+        break;
+    case BUFFER_F64:
+        VIEW_GET(double, CAPSULE_DECIMAL);
+        break;
+    case CAPSULE_TYPE_POINTER:
+        VIEW_GET(void*, CAPSULE_POINTER);
+        break;
+    default:
+        return CAPSULE_ERROR_TYPE;
+    }
+    return CAPSULE_ERROR_NONE;
+}
+
+CapsuleError buffer_ref(Capsule buffer, long view, long offset, Capsule* result) {
+    unsigned char* element;
+    CapsuleError error = buffer_element(buffer, view, offset, &element);
+    if (error)
+        return error;
+
+    return view_load(view, element, result);
+}
+
+#define VIEW_SET(ctype, from)                                                                                                     \
+    do {                                                                                                                          \
+        ctype value = (ctype)(from);                                                                                              \
+        memcpy(element, &value, sizeof(value));                                                                                   \
+    } while (0)
+
+CapsuleError view_store(long view, void* element, Capsule value) {
+    if (view == CAPSULE_TYPE_POINTER) {
+        if (!CAPSULE_NILP(value) && !CAPSULE_POINTERP(value) && !CAPSULE_STRINGP(value))
+            return CAPSULE_ERROR_TYPE;
+        void* pointer = CAPSULE_NILP(value) ? NULL : value.as.pointer;
+        memcpy(element, &pointer, sizeof(pointer));
+        return CAPSULE_ERROR_NONE;
+    }
+
+    if (!CAPSULE_INTEGERP(value) && !(CAPSULE_DECIMALP(value) && (view == BUFFER_F32 || view == BUFFER_F64)))
+        return CAPSULE_ERROR_TYPE;
+
+    long i = CAPSULE_INTEGERP(value) ? value.as.integer : 0;
+    double d = CAPSULE_DECIMALP(value) ? value.as.decimal : (double)i;
+    switch (view) {
+    case BUFFER_U8:
+        VIEW_SET(uint8_t, i);
+        break;
+    case BUFFER_I8:
+        VIEW_SET(int8_t, i);
+        break;
+    case BUFFER_U16:
+        VIEW_SET(uint16_t, i);
+        break;
+    case BUFFER_I16:
+        VIEW_SET(int16_t, i);
+        break;
+    case BUFFER_U32:
+        VIEW_SET(uint32_t, i);
+        break;
+    case BUFFER_I32:
+        VIEW_SET(int32_t, i);
+        break;
+    case BUFFER_U64:
+        VIEW_SET(uint64_t, i);
+        break;
+    case BUFFER_I64:
+        VIEW_SET(int64_t, i);
+        break;
+    case BUFFER_F32:
+        VIEW_SET(float, d);
+        break;
+    case BUFFER_F64:
+        VIEW_SET(double, d);
+        break;
+    default:
+        return CAPSULE_ERROR_TYPE;
+    }
+    return CAPSULE_ERROR_NONE;
+}
+
+CapsuleError buffer_set(Capsule buffer, long view, long offset, Capsule value) {
+    unsigned char* element;
+    CapsuleError error = buffer_element(buffer, view, offset, &element);
+    if (error)
+        return error;
+
+    return view_store(view, element, value);
+}
+
+/* (size (view . offset) ...) with every field aligned to its own size like a C compiler does */
+CapsuleError buffer_layout(Capsule views, Capsule* result) {
+    Capsule fields = Capsule_nil;
+    size_t offset = 0, align = 1;
+
+    for (; !CAPSULE_NILP(views); views = CAPSULE_CDR(views)) {
+        Capsule view = CAPSULE_CAR(views);
+        size_t width = CAPSULE_INTEGERP(view) ? buffer_view_size(view.as.integer) : 0;
+        if (width == 0)
+            return CAPSULE_ERROR_TYPE;
+
+        offset = (offset + width - 1) / width * width;
+        fields = CAPSULE_CONS(CAPSULE_CONS(view, CAPSULE_INTEGER(offset)), fields);
+        offset += width;
+        if (width > align)
+            align = width;
+    }
+
+    Capsule_List_reverse(&fields);
+    *result = CAPSULE_CONS(CAPSULE_INTEGER((offset + align - 1) / align * align), fields);
+    return CAPSULE_ERROR_NONE;
+}
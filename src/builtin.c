@@ -17,6 +17,7 @@
 
 #include "capsule.h"
 #include "priv.h"
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -68,6 +69,28 @@ BUILTIN(cons) {
     return CAPSULE_ERROR_NONE;
 }
 
+/* frozen pairs are remembered before they may point into the young heap */
+static CapsuleError set_pellete(Capsule args, int k, Capsule* result) {
+    if (CAPSULE_NILP(args) || CAPSULE_NILP(CAPSULE_CDR(args)) || !CAPSULE_NILP(CAPSULE_CDR(CAPSULE_CDR(args))))
+        return CAPSULE_ERROR_ARGS;
+
+    Capsule pair = CAPSULE_CAR(args);
+    if (pair.type != CAPSULE_TYPE_PAIR)
+        return CAPSULE_ERROR_TYPE;
+
+    gc_write_barrier(pair);
+    pair.as.pair->pellete[k] = *result = CAPSULE_CAR(CAPSULE_CDR(args));
+    return CAPSULE_ERROR_NONE;
+}
+
+BUILTIN(setcar) {
+    return set_pellete(args, 0, result);
+}
+
+BUILTIN(setcdr) {
+    return set_pellete(args, 1, result);
+}
+
 BUILTIN(eq) {
     Capsule a, b;
     int eq;
@@ -177,19 +200,61 @@ BUILTIN(write) {
 
     args = CAPSULE_CDR(CAPSULE_CDR(args));
 
-    while (*format) {
-        if (*format == '{' && *(format + 1) == '}') {
-            if (!CAPSULE_NILP(args)) {
-                Capsule_print(CAPSULE_CAR(args), file);
-                args = CAPSULE_CDR(args);
-            }
-            format += 2;
-        } else {
-            fputc(*format, file);
-            format++;
+    /* the text between placeholders is copied in one go, flushing is left to the stream's buffering mode */
+    for (;;) {
+        const char* placeholder = strstr(format, "{}");
+        if (placeholder == NULL) {
+            fputs(format, file);
+            break;
         }
+        fwrite(format, sizeof(char), placeholder - format, file);
+        if (!CAPSULE_NILP(args)) {
+            Capsule_print(CAPSULE_CAR(args), file);
+            args = CAPSULE_CDR(args);
+        }
+        format = placeholder + 2;
+    }
+    *result = Capsule_nil;
+    return CAPSULE_ERROR_NONE;
+}
+
+BUILTIN(flush) {
+    if (!CAPSULE_NILP(args) && !CAPSULE_NILP(CAPSULE_CDR(args)))
+        return CAPSULE_ERROR_ARGS;
+
+    /* without a stream every open output stream is flushed */
+    FILE* file = NULL;
+    if (!CAPSULE_NILP(args)) {
+        if (!CAPSULE_POINTERP(CAPSULE_CAR(args)))
+            return CAPSULE_ERROR_TYPE;
+        file = CAPSULE_CAR(args).as.pointer;
     }
-    fflush(file);
+
+    if (fflush(file) != 0)
+        return CAPSULE_ERROR_RUNTIME;
+    *result = Capsule_nil;
+    return CAPSULE_ERROR_NONE;
+}
+
+BUILTIN(setbuffering) {
+    if (CAPSULE_NILP(args) || CAPSULE_NILP(CAPSULE_CDR(args)) || !CAPSULE_NILP(CAPSULE_CDR(CAPSULE_CDR(args))))
+        return CAPSULE_ERROR_ARGS;
+
+    if (!CAPSULE_POINTERP(CAPSULE_CAR(args)) || !CAPSULE_INTEGERP(CAPSULE_CAR(CAPSULE_CDR(args))))
+        return CAPSULE_ERROR_TYPE;
+
+    FILE* file = CAPSULE_CAR(args).as.pointer;
+    int mode = CAPSULE_CAR(CAPSULE_CDR(args)).as.integer;
+    if (mode != _IONBF && mode != _IOLBF && mode != _IOFBF)
+        return CAPSULE_ERROR_ARGS;
+
+    /* setvbuf is only defined before the stream's first read or write */
+    if (stream_used(file)) {
+        fprintf(stderr, "Buffering can only be set before the stream is used\n");
+        return CAPSULE_ERROR_RUNTIME;
+    }
+    if (setvbuf(file, NULL, mode, BUFSIZ) != 0)
+        return CAPSULE_ERROR_RUNTIME;
     *result = Capsule_nil;
     return CAPSULE_ERROR_NONE;
 }
@@ -206,12 +271,262 @@ BUILTIN(read) {
     FILE* file = CAPSULE_CAR(args).as.pointer;
 
     size_t read = fread(buffer, sizeof(char), sizeof(buffer), file);
-    buffer[read] = '\0';
+    memcpy(string_alloc(read, result), buffer, read);
+    return CAPSULE_ERROR_NONE;
+}
 
-    *result = CAPSULE_STRING(strdup(buffer));
+/* lines are read into one buffer reused across calls and copied once into their string */
+static char* line_buffer = NULL;
+static size_t line_capacity = 0;
+
+static int read_line(FILE* file, Capsule* result) {
+    ssize_t length = getline(&line_buffer, &line_capacity, file);
+    if (length < 0)
+        return 0;
+
+    if (length > 0 && line_buffer[length - 1] == '\n')
+        length--;
+    memcpy(string_alloc(length, result), line_buffer, length);
+    return 1;
+}
+
+BUILTIN(readline) {
+    if (CAPSULE_NILP(args) || !CAPSULE_NILP(CAPSULE_CDR(args)))
+        return CAPSULE_ERROR_ARGS;
+
+    if (!CAPSULE_POINTERP(CAPSULE_CAR(args)))
+        return CAPSULE_ERROR_TYPE;
+
+    if (!read_line(CAPSULE_CAR(args).as.pointer, result))
+        *result = Capsule_nil;
+    return CAPSULE_ERROR_NONE;
+}
+
+/* reads up to LIMIT bytes straight into a string that grows as they come, a short file never costs LIMIT */
+static CapsuleError read_string(FILE* file, size_t limit, size_t* read, Capsule* result) {
+    size_t capacity = limit < BUFSIZ ? limit : BUFSIZ;
+    Allocation* alloc = string_grow(NULL, capacity);
+
+    *read = 0;
+    while (alloc != NULL) {
+        *read += fread((char*)(alloc + 1) + *read, sizeof(char), capacity - *read, file);
+        if (*read < capacity || capacity == limit)
+            break;
+        capacity = capacity < limit / 2 ? capacity * 2 : limit;
+        Allocation* grown = string_grow(alloc, capacity);
+        if (grown == NULL)
+            free(alloc);
+        alloc = grown;
+    }
+    if (alloc == NULL)
+        return CAPSULE_ERROR_RUNTIME;
+
+    string_finish(alloc, *read, result);
     return CAPSULE_ERROR_NONE;
 }
 
+BUILTIN(readbytes) {
+    if (CAPSULE_NILP(args) || CAPSULE_NILP(CAPSULE_CDR(args)) || !CAPSULE_NILP(CAPSULE_CDR(CAPSULE_CDR(args))))
+        return CAPSULE_ERROR_ARGS;
+
+    if (!CAPSULE_POINTERP(CAPSULE_CAR(args)) || !CAPSULE_INTEGERP(CAPSULE_CAR(CAPSULE_CDR(args))))
+        return CAPSULE_ERROR_TYPE;
+
+    long size = CAPSULE_CAR(CAPSULE_CDR(args)).as.integer;
+    size_t read;
+    CapsuleError error;
+
+    if (size < 0)
+        return CAPSULE_ERROR_ARGS;
+    if ((error = read_string(CAPSULE_CAR(args).as.pointer, size, &read, result)))
+        return error;
+
+    if (read == 0 && size > 0)
+        *result = Capsule_nil;
+    return CAPSULE_ERROR_NONE;
+}
+
+BUILTIN(readall) {
+    if (CAPSULE_NILP(args) || !CAPSULE_NILP(CAPSULE_CDR(args)))
+        return CAPSULE_ERROR_ARGS;
+
+    if (!CAPSULE_POINTERP(CAPSULE_CAR(args)))
+        return CAPSULE_ERROR_TYPE;
+
+    size_t read;
+    return read_string(CAPSULE_CAR(args).as.pointer, SIZE_MAX, &read, result);
+}
+
+/* one read(2) worth of input, so a stream found readable never blocks */
+BUILTIN(readsome) {
+    long size = BUFSIZ;
+
+    if (CAPSULE_NILP(args) || (!CAPSULE_NILP(CAPSULE_CDR(args)) && !CAPSULE_NILP(CAPSULE_CDR(CAPSULE_CDR(args)))))
+        return CAPSULE_ERROR_ARGS;
+
+    if (!CAPSULE_POINTERP(CAPSULE_CAR(args)))
+        return CAPSULE_ERROR_TYPE;
+
+    if (!CAPSULE_NILP(CAPSULE_CDR(args))) {
+        if (!CAPSULE_INTEGERP(CAPSULE_CAR(CAPSULE_CDR(args))))
+            return CAPSULE_ERROR_TYPE;
+        size = CAPSULE_CAR(CAPSULE_CDR(args)).as.integer;
+        if (size <= 0)
+            return CAPSULE_ERROR_ARGS;
+    }
+
+    FILE* file = CAPSULE_CAR(args).as.pointer;
+    size_t pending = stream_pending(file);
+    char* buffer = string_alloc(size, result);
+    ssize_t count;
+
+    /* whatever stdio already buffered goes first */
+    if (pending > 0) {
+        count = fread(buffer, sizeof(char), pending < (size_t)size ? pending : (size_t)size, file);
+    } else {
+        do {
+            count = read(fileno(file), buffer, size);
+        } while (count < 0 && errno == EINTR);
+    }
+
+    if (count < 0)
+        return CAPSULE_ERROR_RUNTIME;
+    buffer[count] = '\0';
+    if (count == 0)
+        *result = Capsule_nil;
+    return CAPSULE_ERROR_NONE;
+}
+
+/* calls FN with every value NEXT produces, the value is rooted until the call has bound it */
+static CapsuleError for_each(FormSource next, void* source, Capsule fn, Capsule* result) {
+    Capsule value = Capsule_nil, stack = Capsule_nil;
+    EvalState state = {.expr = &value, .scope = &fn, .stack = &stack, .result = result, .parent = eval_state};
+    CapsuleError error;
+
+    eval_state = &state;
+    while (!(error = next(source, &value))) {
+        if ((error = Capsule_apply(fn, 1, &value, result)))
+            break;
+    }
+    eval_state = state.parent;
+
+    if (error == CAPSULE_ERROR_EOF) {
+        *result = Capsule_nil;
+        return CAPSULE_ERROR_NONE;
+    }
+    return error;
+}
+
+/* FOR-EACH-LINE keeps its own buffer so FN is free to READ-LINE elsewhere */
+typedef struct {
+    FILE* file;
+    char* buffer;
+    size_t capacity;
+} LineSource;
+
+static CapsuleError line_next(void* source, Capsule* result) {
+    LineSource* lines = source;
+    ssize_t length = getline(&lines->buffer, &lines->capacity, lines->file);
+    if (length < 0)
+        return CAPSULE_ERROR_EOF;
+
+    if (length > 0 && lines->buffer[length - 1] == '\n')
+        length--;
+    memcpy(string_alloc(length, result), lines->buffer, length);
+    return CAPSULE_ERROR_NONE;
+}
+
+BUILTIN(foreachline) {
+    if (CAPSULE_NILP(args) || CAPSULE_NILP(CAPSULE_CDR(args)) || !CAPSULE_NILP(CAPSULE_CDR(CAPSULE_CDR(args))))
+        return CAPSULE_ERROR_ARGS;
+
+    if (!CAPSULE_POINTERP(CAPSULE_CAR(args)))
+        return CAPSULE_ERROR_TYPE;
+
+    LineSource lines = {.file = CAPSULE_CAR(args).as.pointer};
+    CapsuleError error = for_each(line_next, &lines, CAPSULE_CAR(CAPSULE_CDR(args)), result);
+    free(lines.buffer);
+    return error;
+}
+
+static CapsuleError csv_next(void* file, Capsule* result) {
+    return csv_read(file, result);
+}
+
+BUILTIN(readcsv) {
+    if (CAPSULE_NILP(args) || !CAPSULE_NILP(CAPSULE_CDR(args)))
+        return CAPSULE_ERROR_ARGS;
+
+    if (!CAPSULE_POINTERP(CAPSULE_CAR(args)))
+        return CAPSULE_ERROR_TYPE;
+
+    CapsuleError error = csv_read(CAPSULE_CAR(args).as.pointer, result);
+    if (error == CAPSULE_ERROR_EOF) {
+        *result = Capsule_nil;
+        return CAPSULE_ERROR_NONE;
+    }
+    return error;
+}
+
+BUILTIN(foreachcsv) {
+    if (CAPSULE_NILP(args) || CAPSULE_NILP(CAPSULE_CDR(args)) || !CAPSULE_NILP(CAPSULE_CDR(CAPSULE_CDR(args))))
+        return CAPSULE_ERROR_ARGS;
+
+    if (!CAPSULE_POINTERP(CAPSULE_CAR(args)))
+        return CAPSULE_ERROR_TYPE;
+
+    return for_each(csv_next, CAPSULE_CAR(args).as.pointer, CAPSULE_CAR(CAPSULE_CDR(args)), result);
+}
+
+BUILTIN(writecsv) {
+    if (CAPSULE_NILP(args) || CAPSULE_NILP(CAPSULE_CDR(args)) || !CAPSULE_NILP(CAPSULE_CDR(CAPSULE_CDR(args))))
+        return CAPSULE_ERROR_ARGS;
+
+    if (!CAPSULE_POINTERP(CAPSULE_CAR(args)))
+        return CAPSULE_ERROR_TYPE;
+
+    *result = Capsule_nil;
+    return csv_write(CAPSULE_CAR(args).as.pointer, CAPSULE_CAR(CAPSULE_CDR(args)));
+}
+
+BUILTIN(readjson) {
+    if (CAPSULE_NILP(args) || !CAPSULE_NILP(CAPSULE_CDR(args)))
+        return CAPSULE_ERROR_ARGS;
+
+    if (!CAPSULE_POINTERP(CAPSULE_CAR(args)))
+        return CAPSULE_ERROR_TYPE;
+
+    CapsuleError error = json_read(CAPSULE_CAR(args).as.pointer, result);
+    if (error == CAPSULE_ERROR_EOF) {
+        *result = Capsule_nil;
+        return CAPSULE_ERROR_NONE;
+    }
+    return error;
+}
+
+BUILTIN(foreachjson) {
+    if (CAPSULE_NILP(args) || CAPSULE_NILP(CAPSULE_CDR(args)) || !CAPSULE_NILP(CAPSULE_CDR(CAPSULE_CDR(args))))
+        return CAPSULE_ERROR_ARGS;
+
+    if (!CAPSULE_POINTERP(CAPSULE_CAR(args)))
+        return CAPSULE_ERROR_TYPE;
+
+    JsonStream stream;
+    json_stream_init(&stream, CAPSULE_CAR(args).as.pointer);
+    return for_each(json_stream_next, &stream, CAPSULE_CAR(CAPSULE_CDR(args)), result);
+}
+
+BUILTIN(writejson) {
+    if (CAPSULE_NILP(args) || CAPSULE_NILP(CAPSULE_CDR(args)) || !CAPSULE_NILP(CAPSULE_CDR(CAPSULE_CDR(args))))
+        return CAPSULE_ERROR_ARGS;
+
+    if (!CAPSULE_POINTERP(CAPSULE_CAR(args)))
+        return CAPSULE_ERROR_TYPE;
+
+    *result = Capsule_nil;
+    return json_write(CAPSULE_CAR(args).as.pointer, CAPSULE_CAR(CAPSULE_CDR(args)));
+}
+
 BUILTIN(close) {
     if (CAPSULE_NILP(args) || !CAPSULE_NILP(CAPSULE_CDR(args)))
         return CAPSULE_ERROR_ARGS;
@@ -274,11 +589,17 @@ BUILTIN(slurp) {
     if (!CAPSULE_STRINGP(CAPSULE_CAR(args)))
         return CAPSULE_ERROR_TYPE;
 
-    char* file = slurp(CAPSULE_CAR(args).as.symbol);
+    const char* path = CAPSULE_AS_STRING(CAPSULE_CAR(args));
+    if (string_map(path, result) == CAPSULE_ERROR_NONE)
+        return CAPSULE_ERROR_NONE;
+
+    /* not a regular file, read it through stdio instead */
+    char* file = slurp(path);
     if (file == NULL)
         return CAPSULE_ERROR_RUNTIME;
 
     *result = CAPSULE_STRING(file);
+    free(file);
     return CAPSULE_ERROR_NONE;
 }
 
@@ -292,6 +613,16 @@ BUILTIN(eval) {
     return Capsule_eval(source, Capsule_Scope_global(), result);
 }
 
+BUILTIN(loadfile) {
+    if (CAPSULE_NILP(args) || !CAPSULE_NILP(CAPSULE_CDR(args)))
+        return CAPSULE_ERROR_ARGS;
+    if (!CAPSULE_STRINGP(CAPSULE_CAR(args)))
+        return CAPSULE_ERROR_TYPE;
+
+    /* loaded files are cached, the script a program runs is read as it is */
+    return load_file(CAPSULE_AS_STRING(CAPSULE_CAR(args)), 1, Capsule_Scope_global(), result);
+}
+
 BUILTIN(typeof) {
     if (CAPSULE_NILP(args) || !CAPSULE_NILP(CAPSULE_CDR(args)))
         return CAPSULE_ERROR_ARGS;
@@ -313,6 +644,540 @@ BUILTIN(popen) {
     return CAPSULE_ERROR_NONE;
 }
 
+static CapsuleError capture(Capsule args, int escape, Capsule scope, Capsule* result) {
+    if (CAPSULE_NILP(args) || !CAPSULE_NILP(CAPSULE_CDR(args)))
+        return CAPSULE_ERROR_ARGS;
+
+    Capsule proc = CAPSULE_CAR(args);
+    if (proc.type != CAPSULE_TYPE_CLOSURE && proc.type != CAPSULE_TYPE_BUILTIN)
+        return CAPSULE_ERROR_TYPE;
+
+    return eval_capture(proc, escape, scope, result);
+}
+
+BUILTIN(callcurrent) {
+    return capture(args, 0, scope, result);
+}
+
+BUILTIN(callescape) {
+    return capture(args, 1, scope, result);
+}
+
+BUILTIN(spawn) {
+    Capsule call, tail;
+
+    if (CAPSULE_NILP(args))
+        return CAPSULE_ERROR_ARGS;
+
+    /* the arguments are already evaluated, quote them for the task's first call */
+    call = tail = CAPSULE_CONS(CAPSULE_CAR(args), Capsule_nil);
+    for (args = CAPSULE_CDR(args); !CAPSULE_NILP(args); args = CAPSULE_CDR(args)) {
+        CAPSULE_CDR(tail) = CAPSULE_CONS(CAPSULE_CONS(CAPSULE_SYMBOL("QUOTE"), CAPSULE_CONS(CAPSULE_CAR(args), Capsule_nil)), Capsule_nil);
+        tail = CAPSULE_CDR(tail);
+    }
+
+    long id = sched_spawn(call, scope);
+    if (id == 0)
+        return CAPSULE_ERROR_RUNTIME;
+    *result = CAPSULE_INTEGER(id);
+    return CAPSULE_ERROR_NONE;
+}
+
+BUILTIN(join) {
+    if (CAPSULE_NILP(args) || !CAPSULE_NILP(CAPSULE_CDR(args)))
+        return CAPSULE_ERROR_ARGS;
+
+    if (!CAPSULE_INTEGERP(CAPSULE_CAR(args)))
+        return CAPSULE_ERROR_TYPE;
+
+    return sched_join(CAPSULE_CAR(args).as.integer, result);
+}
+
+BUILTIN(yield) {
+    if (!CAPSULE_NILP(args))
+        return CAPSULE_ERROR_ARGS;
+
+    return sched_yield(result);
+}
+
+BUILTIN(sleep) {
+    if (CAPSULE_NILP(args) || !CAPSULE_NILP(CAPSULE_CDR(args)))
+        return CAPSULE_ERROR_ARGS;
+
+    Capsule seconds = CAPSULE_CAR(args);
+    if (CAPSULE_INTEGERP(seconds))
+        return sched_sleep(seconds.as.integer, result);
+    if (seconds.type == CAPSULE_TYPE_DECIMAL)
+        return sched_sleep(seconds.as.decimal, result);
+    return CAPSULE_ERROR_TYPE;
+}
+
+/* streams with input left in their stdio buffer are ready without asking the kernel */
+static CapsuleError await(Capsule args, int writable, Capsule* result) {
+    if (CAPSULE_NILP(args) || !CAPSULE_NILP(CAPSULE_CDR(args)))
+        return CAPSULE_ERROR_ARGS;
+
+    Capsule target = CAPSULE_CAR(args);
+    if (CAPSULE_INTEGERP(target))
+        return sched_await(target.as.integer, writable, result);
+    if (!CAPSULE_POINTERP(target))
+        return CAPSULE_ERROR_TYPE;
+
+    if (!writable && stream_pending(target.as.pointer) > 0) {
+        *result = CAPSULE_SYMBOL("T");
+        return CAPSULE_ERROR_NONE;
+    }
+    return sched_await(fileno(target.as.pointer), writable, result);
+}
+
+BUILTIN(awaitreadable) {
+    return await(args, 0, result);
+}
+
+BUILTIN(awaitwritable) {
+    return await(args, 1, result);
+}
+
+BUILTIN(makechannel) {
+    long capacity = 0;
+
+    if (!CAPSULE_NILP(args)) {
+        if (!CAPSULE_NILP(CAPSULE_CDR(args)))
+            return CAPSULE_ERROR_ARGS;
+        if (!CAPSULE_INTEGERP(CAPSULE_CAR(args)))
+            return CAPSULE_ERROR_TYPE;
+        capacity = CAPSULE_CAR(args).as.integer;
+    }
+
+    *result = sched_channel(capacity);
+    return CAPSULE_ERROR_NONE;
+}
+
+BUILTIN(channelsend) {
+    if (CAPSULE_NILP(args) || CAPSULE_NILP(CAPSULE_CDR(args)) || !CAPSULE_NILP(CAPSULE_CDR(CAPSULE_CDR(args))))
+        return CAPSULE_ERROR_ARGS;
+
+    if (!sched_channelp(CAPSULE_CAR(args)))
+        return CAPSULE_ERROR_TYPE;
+
+    return sched_send(CAPSULE_CAR(args), CAPSULE_CAR(CAPSULE_CDR(args)), result);
+}
+
+BUILTIN(channelreceive) {
+    if (CAPSULE_NILP(args) || !CAPSULE_NILP(CAPSULE_CDR(args)))
+        return CAPSULE_ERROR_ARGS;
+
+    if (!sched_channelp(CAPSULE_CAR(args)))
+        return CAPSULE_ERROR_TYPE;
+
+    return sched_receive(CAPSULE_CAR(args), result);
+}
+
+BUILTIN(channelclose) {
+    if (CAPSULE_NILP(args) || !CAPSULE_NILP(CAPSULE_CDR(args)))
+        return CAPSULE_ERROR_ARGS;
+
+    if (!sched_channelp(CAPSULE_CAR(args)))
+        return CAPSULE_ERROR_TYPE;
+
+    sched_close(CAPSULE_CAR(args));
+    *result = Capsule_nil;
+    return CAPSULE_ERROR_NONE;
+}
+
+/* the arguments of a builtin taking between MIN and MAX of them, missing ones are NIL */
+static int args_split(Capsule args, int min, int max, Capsule* out) {
+    int n = 0;
+
+    for (; !CAPSULE_NILP(args); args = CAPSULE_CDR(args), n++) {
+        if (n == max)
+            return 0;
+        out[n] = CAPSULE_CAR(args);
+    }
+    for (int i = n; i < max; i++)
+        out[i] = Capsule_nil;
+    return n >= min;
+}
+
+BUILTIN(makebuffer) {
+    Capsule arg[1];
+    if (!args_split(args, 1, 1, arg))
+        return CAPSULE_ERROR_ARGS;
+    if (!CAPSULE_INTEGERP(arg[0]) || arg[0].as.integer < 0)
+        return CAPSULE_ERROR_TYPE;
+
+    return buffer_new(arg[0].as.integer, result);
+}
+
+BUILTIN(bufferp) {
+    unsigned char* data;
+    size_t size;
+    Capsule arg[1];
+    if (!args_split(args, 1, 1, arg))
+        return CAPSULE_ERROR_ARGS;
+
+    *result = buffer_data(arg[0], &data, &size) ? CAPSULE_SYMBOL("T") : Capsule_nil;
+    return CAPSULE_ERROR_NONE;
+}
+
+BUILTIN(buffersize) {
+    unsigned char* data;
+    size_t size;
+    Capsule arg[1];
+    if (!args_split(args, 1, 1, arg))
+        return CAPSULE_ERROR_ARGS;
+    if (!buffer_data(arg[0], &data, &size))
+        return CAPSULE_ERROR_TYPE;
+
+    *result = CAPSULE_INTEGER(size);
+    return CAPSULE_ERROR_NONE;
+}
+
+BUILTIN(bufferref) {
+    Capsule arg[3];
+    if (!args_split(args, 3, 3, arg))
+        return CAPSULE_ERROR_ARGS;
+    if (!CAPSULE_INTEGERP(arg[1]) || !CAPSULE_INTEGERP(arg[2]))
+        return CAPSULE_ERROR_TYPE;
+
+    return buffer_ref(arg[0], arg[1].as.integer, arg[2].as.integer, result);
+}
+
+BUILTIN(bufferset) {
+    Capsule arg[4];
+    if (!args_split(args, 4, 4, arg))
+        return CAPSULE_ERROR_ARGS;
+    if (!CAPSULE_INTEGERP(arg[1]) || !CAPSULE_INTEGERP(arg[2]))
+        return CAPSULE_ERROR_TYPE;
+
+    *result = arg[3];
+    return buffer_set(arg[0], arg[1].as.integer, arg[2].as.integer, arg[3]);
+}
+
+BUILTIN(string2buffer) {
+    unsigned char* data;
+    size_t size;
+    Capsule arg[1];
+    if (!args_split(args, 1, 1, arg))
+        return CAPSULE_ERROR_ARGS;
+    if (!CAPSULE_STRINGP(arg[0]))
+        return CAPSULE_ERROR_TYPE;
+
+    CapsuleError error = buffer_new(strlen(arg[0].as.symbol), result);
+    if (error)
+        return error;
+    buffer_data(*result, &data, &size);
+    memcpy(data, arg[0].as.symbol, size);
+    return CAPSULE_ERROR_NONE;
+}
+
+/* (buffer->string buffer [start [end]]), the bytes up to the first zero byte */
+BUILTIN(buffer2string) {
+    unsigned char* data;
+    size_t size;
+    Capsule arg[3];
+    if (!args_split(args, 1, 3, arg))
+        return CAPSULE_ERROR_ARGS;
+    if (!buffer_data(arg[0], &data, &size) || (!CAPSULE_NILP(arg[1]) && !CAPSULE_INTEGERP(arg[1])) ||
+        (!CAPSULE_NILP(arg[2]) && !CAPSULE_INTEGERP(arg[2])))
+        return CAPSULE_ERROR_TYPE;
+
+    long start = CAPSULE_NILP(arg[1]) ? 0 : arg[1].as.integer;
+    long end = CAPSULE_NILP(arg[2]) ? (long)size : arg[2].as.integer;
+    if (start < 0 || end < start || (size_t)end > size)
+        return CAPSULE_ERROR_ARGS;
+
+    memcpy(string_alloc(end - start, result), data + start, end - start);
+    return CAPSULE_ERROR_NONE;
+}
+
+/* (buffer->list buffer view), every element of the buffer seen through VIEW */
+BUILTIN(buffer2list) {
+    unsigned char* data;
+    size_t size, width;
+    Capsule arg[2], value;
+    CapsuleError error;
+    if (!args_split(args, 2, 2, arg))
+        return CAPSULE_ERROR_ARGS;
+    if (!buffer_data(arg[0], &data, &size) || !CAPSULE_INTEGERP(arg[1]) || !(width = buffer_view_size(arg[1].as.integer)))
+        return CAPSULE_ERROR_TYPE;
+
+    *result = Capsule_nil;
+    for (size_t offset = size / width * width; offset > 0; offset -= width) {
+        if ((error = buffer_ref(arg[0], arg[1].as.integer, offset - width, &value)))
+            return error;
+        *result = CAPSULE_CONS(value, *result);
+    }
+    return CAPSULE_ERROR_NONE;
+}
+
+/* (list->buffer view list), a buffer holding the elements of LIST as VIEW */
+BUILTIN(list2buffer) {
+    size_t width, count = 0;
+    long offset = 0;
+    Capsule arg[2], buffer;
+    CapsuleError error;
+    if (!args_split(args, 2, 2, arg))
+        return CAPSULE_ERROR_ARGS;
+    if (!CAPSULE_INTEGERP(arg[0]) || !(width = buffer_view_size(arg[0].as.integer)) || !Capsule_Listp(arg[1]))
+        return CAPSULE_ERROR_TYPE;
+
+    for (Capsule l = arg[1]; !CAPSULE_NILP(l); l = CAPSULE_CDR(l))
+        count++;
+    if ((error = buffer_new(width * count, &buffer)))
+        return error;
+    for (Capsule l = arg[1]; !CAPSULE_NILP(l); l = CAPSULE_CDR(l), offset += width)
+        if ((error = buffer_set(buffer, arg[0].as.integer, offset, CAPSULE_CAR(l))))
+            return error;
+
+    *result = buffer;
+    return CAPSULE_ERROR_NONE;
+}
+
+/* (pointer-ref pointer view [offset]), foreign memory is read unchecked */
+BUILTIN(pointerref) {
+    Capsule arg[3];
+    if (!args_split(args, 2, 3, arg))
+        return CAPSULE_ERROR_ARGS;
+    if (!CAPSULE_POINTERP(arg[0]) || arg[0].as.pointer == NULL || !CAPSULE_INTEGERP(arg[1]) ||
+        (!CAPSULE_NILP(arg[2]) && !CAPSULE_INTEGERP(arg[2])))
+        return CAPSULE_ERROR_TYPE;
+
+    return view_load(arg[1].as.integer, (char*)arg[0].as.pointer + (CAPSULE_NILP(arg[2]) ? 0 : arg[2].as.integer), result);
+}
+
+/* (pointer-set! pointer view offset value) */
+BUILTIN(pointerset) {
+    Capsule arg[4];
+    if (!args_split(args, 4, 4, arg))
+        return CAPSULE_ERROR_ARGS;
+    if (!CAPSULE_POINTERP(arg[0]) || arg[0].as.pointer == NULL || !CAPSULE_INTEGERP(arg[1]) || !CAPSULE_INTEGERP(arg[2]))
+        return CAPSULE_ERROR_TYPE;
+
+    *result = arg[3];
+    return view_store(arg[1].as.integer, (char*)arg[0].as.pointer + arg[2].as.integer, arg[3]);
+}
+
+BUILTIN(structlayout) {
+    return buffer_layout(args, result);
+}
+
+/* the (view . offset) of field K of LAYOUT */
+static CapsuleError struct_field(Capsule layout, Capsule k, Capsule* field) {
+    if (layout.type != CAPSULE_TYPE_PAIR || !CAPSULE_INTEGERP(k))
+        return CAPSULE_ERROR_TYPE;
+
+    long i = k.as.integer;
+    for (layout = CAPSULE_CDR(layout); i > 0 && layout.type == CAPSULE_TYPE_PAIR; i--)
+        layout = CAPSULE_CDR(layout);
+    if (i < 0 || layout.type != CAPSULE_TYPE_PAIR)
+        return CAPSULE_ERROR_ARGS;
+
+    *field = CAPSULE_CAR(layout);
+    if (field->type != CAPSULE_TYPE_PAIR || !CAPSULE_INTEGERP(CAPSULE_CAR(*field)) || !CAPSULE_INTEGERP(CAPSULE_CDR(*field)))
+        return CAPSULE_ERROR_TYPE;
+    return CAPSULE_ERROR_NONE;
+}
+
+BUILTIN(structref) {
+    Capsule arg[3], field;
+    CapsuleError error;
+    if (!args_split(args, 3, 3, arg))
+        return CAPSULE_ERROR_ARGS;
+    if ((error = struct_field(arg[1], arg[2], &field)))
+        return error;
+
+    return buffer_ref(arg[0], CAPSULE_CAR(field).as.integer, CAPSULE_CDR(field).as.integer, result);
+}
+
+BUILTIN(structset) {
+    Capsule arg[4], field;
+    CapsuleError error;
+    if (!args_split(args, 4, 4, arg))
+        return CAPSULE_ERROR_ARGS;
+    if ((error = struct_field(arg[1], arg[2], &field)))
+        return error;
+
+    *result = arg[3];
+    return buffer_set(arg[0], CAPSULE_CAR(field).as.integer, CAPSULE_CDR(field).as.integer, arg[3]);
+}
+
+/* a module is named by a string or a symbol, symbols name the library in lowercase */
+static CapsuleError module_id(Capsule name, char* id, size_t size) {
+    if (!CAPSULE_STRINGP(name) && !CAPSULE_SYMBOLP(name))
+        return CAPSULE_ERROR_TYPE;
+    if (strlen(name.as.symbol) >= size)
+        return CAPSULE_ERROR_ARGS;
+
+    size_t i = 0;
+    for (const char* c = name.as.symbol; *c != '\0'; c++)
+        id[i++] = CAPSULE_SYMBOLP(name) && *c >= 'A' && *c <= 'Z' ? *c - 'A' + 'a' : *c;
+    id[i] = '\0';
+    return CAPSULE_ERROR_NONE;
+}
+
+BUILTIN(require) {
+    char id[256];
+    Capsule arg[1];
+    CapsuleError error;
+    if (!args_split(args, 1, 1, arg))
+        return CAPSULE_ERROR_ARGS;
+    if ((error = module_id(arg[0], id, sizeof(id))))
+        return error;
+
+    return module_require(id, result);
+}
+
+/* (import module [name ...]) binds the module's builtins, or only NAMEs, in the calling scope */
+BUILTIN(import) {
+    char id[256];
+    Capsule module, value;
+    CapsuleError error;
+    if (CAPSULE_NILP(args))
+        return CAPSULE_ERROR_ARGS;
+    if ((error = module_id(CAPSULE_CAR(args), id, sizeof(id))) || (error = module_require(id, &module)))
+        return error;
+
+    if (CAPSULE_NILP(CAPSULE_CDR(args))) {
+        for (Capsule b = CAPSULE_CDR(module); !CAPSULE_NILP(b); b = CAPSULE_CDR(b))
+            Capsule_Scope_define(scope, CAPSULE_CAR(CAPSULE_CAR(b)), CAPSULE_CDR(CAPSULE_CAR(b)));
+    }
+    for (Capsule names = CAPSULE_CDR(args); !CAPSULE_NILP(names); names = CAPSULE_CDR(names)) {
+        if (!CAPSULE_SYMBOLP(CAPSULE_CAR(names)))
+            return CAPSULE_ERROR_TYPE;
+        if ((error = Capsule_Scope_lookup(module, CAPSULE_CAR(names), &value)))
+            return error;
+        Capsule_Scope_define(scope, CAPSULE_CAR(names), value);
+    }
+
+    *result = module;
+    return CAPSULE_ERROR_NONE;
+}
+
+/* monotonic, for measuring intervals */
+BUILTIN(currenttimens) {
+    if (!CAPSULE_NILP(args))
+        return CAPSULE_ERROR_ARGS;
+    *result = CAPSULE_INTEGER((long)clock_ns(CLOCK_MONOTONIC));
+    return CAPSULE_ERROR_NONE;
+}
+
+BUILTIN(cputimens) {
+    if (!CAPSULE_NILP(args))
+        return CAPSULE_ERROR_ARGS;
+    *result = CAPSULE_INTEGER((long)clock_ns(CLOCK_PROCESS_CPUTIME_ID));
+    return CAPSULE_ERROR_NONE;
+}
+
+/* (wall-ns cpu-ns steps bytes-allocated collections gc-ns) since startup */
+static Capsule runtime_snapshot() {
+    long stats[] = {(long)clock_ns(CLOCK_MONOTONIC),  (long)clock_ns(CLOCK_PROCESS_CPUTIME_ID),
+                    (long)runtime_stats.steps,        (long)runtime_stats.allocated,
+                    (long)runtime_stats.collections, (long)runtime_stats.gc_ns};
+    Capsule snapshot = Capsule_nil;
+
+    for (int i = sizeof(stats) / sizeof(stats[0]) - 1; i >= 0; i--)
+        snapshot = CAPSULE_CONS(CAPSULE_INTEGER(stats[i]), snapshot);
+    return snapshot;
+}
+
+BUILTIN(runtimestats) {
+    if (!CAPSULE_NILP(args))
+        return CAPSULE_ERROR_ARGS;
+    *result = runtime_snapshot();
+    return CAPSULE_ERROR_NONE;
+}
+
+/* (time-report start value) reports what was spent since the RUNTIME-STATS START and returns VALUE */
+BUILTIN(timereport) {
+    Capsule arg[2];
+    long delta[6];
+    int i = 0;
+    if (!args_split(args, 2, 2, arg))
+        return CAPSULE_ERROR_ARGS;
+
+    for (Capsule a = arg[0], b = runtime_snapshot(); i < 6; a = CAPSULE_CDR(a), b = CAPSULE_CDR(b), i++) {
+        if (a.type != CAPSULE_TYPE_PAIR || !CAPSULE_INTEGERP(CAPSULE_CAR(a)))
+            return CAPSULE_ERROR_TYPE;
+        delta[i] = CAPSULE_AS_INTEGER(CAPSULE_CAR(b)) - CAPSULE_AS_INTEGER(CAPSULE_CAR(a));
+    }
+
+    fprintf(stderr, "time: %.3f ms wall, %.3f ms cpu, %ld steps, %ld bytes, %ld gc in %.3f ms\n", delta[0] / 1e6,
+            delta[1] / 1e6, delta[2], delta[3], delta[4], delta[5] / 1e6);
+    *result = arg[1];
+    return CAPSULE_ERROR_NONE;
+}
+
+#ifdef EVAL_STATS
+/* (eval-stats [reset]) the evaluator counters as ((name . count) ...), RESET clears them after reading */
+BUILTIN(evalstats) {
+    static const char* FORMS[CAPSULE_FORM_COUNT] = {"QUOTE", "DEFINE", "LAMBDA", "BEGIN", "IF", "DEFMACRO", "APPLY", "SET!"};
+    Capsule arg[1];
+    CapsuleStats stats;
+    if (!args_split(args, 0, 1, arg))
+        return CAPSULE_ERROR_ARGS;
+
+    Capsule_stats(&stats);
+    if (!CAPSULE_NILP(arg[0]))
+        Capsule_stats_reset();
+
+    const struct {
+        const char* name;
+        size_t count;
+    } counters[] = {
+        {"STEPS", stats.steps},
+        {"CLOSURE-CALLS", stats.closure_calls},
+        {"BUILTIN-CALLS", stats.builtin_calls},
+        {"MACRO-EXPANSIONS", stats.macro_expansions},
+        {"LOOKUPS", stats.lookups},
+        {"LOOKUP-SCOPES", stats.lookup_scopes},
+        {"LOOKUP-BINDINGS", stats.lookup_bindings},
+    };
+
+    *result = Capsule_nil;
+    for (int i = CAPSULE_FORM_COUNT - 1; i >= 0; i--)
+        *result = CAPSULE_CONS(CAPSULE_CONS(CAPSULE_SYMBOL(FORMS[i]), CAPSULE_INTEGER((long)stats.forms[i])), *result);
+    for (int i = sizeof(counters) / sizeof(counters[0]) - 1; i >= 0; i--)
+        *result = CAPSULE_CONS(CAPSULE_CONS(CAPSULE_SYMBOL(counters[i].name), CAPSULE_INTEGER((long)counters[i].count)), *result);
+    return CAPSULE_ERROR_NONE;
+}
+#endif
+
+/* (profile-start [path]) samples the running program into folded stacks, written to PATH when it stops */
+BUILTIN(profilestart) {
+    Capsule arg[1] = {Capsule_nil};
+    if (!args_split(args, 0, 1, arg))
+        return CAPSULE_ERROR_ARGS;
+    if (!CAPSULE_NILP(arg[0]) && !CAPSULE_STRINGP(arg[0]))
+        return CAPSULE_ERROR_TYPE;
+
+    *result = Capsule_nil;
+    return profile_start(CAPSULE_NILP(arg[0]) ? "capsule.folded" : CAPSULE_AS_STRING(arg[0]), scope);
+}
+
+BUILTIN(profilestop) {
+    size_t count;
+    CapsuleError error;
+    if (!CAPSULE_NILP(args))
+        return CAPSULE_ERROR_ARGS;
+    if ((error = profile_stop(&count)))
+        return error;
+
+    *result = CAPSULE_INTEGER(count);
+    return CAPSULE_ERROR_NONE;
+}
+
+#ifdef PROFILE_ALLOC
+/* (allocation-profile) the sampled ((site type count bytes) ...) so far, largest first */
+BUILTIN(allocationprofile) {
+    if (!CAPSULE_NILP(args))
+        return CAPSULE_ERROR_ARGS;
+
+    *result = profile_allocations();
+    return CAPSULE_ERROR_NONE;
+}
+#endif
+
 BUILTIN(ref) {
     if (CAPSULE_NILP(args) || !CAPSULE_NILP(CAPSULE_CDR(args)))
         return CAPSULE_ERROR_ARGS;
@@ -329,6 +1194,13 @@ static ffi_type* FFI_TYPE_MAP[] = {
     &ffi_type_double,  &ffi_type_pointer, &ffi_type_pointer, &ffi_type_pointer, &ffi_type_pointer,
 };
 
+/* the collector closes a handle once, a library opened again holds an extra reference to drop here */
+static Capsule library_handle(void* handler) {
+    if (managed_pointerp(CAPSULE_POINTER(handler), CAPSULE_DEALLOCATOR(dlclose)))
+        dlclose(handler);
+    return Capsule_managed_pointer(handler, CAPSULE_DEALLOCATOR(dlclose));
+}
+
 BUILTIN(loadlibrary) {
     if (CAPSULE_NILP(args) || !CAPSULE_NILP(CAPSULE_CDR(args)))
         return CAPSULE_ERROR_ARGS;
@@ -341,7 +1213,278 @@ BUILTIN(loadlibrary) {
     if (handler == NULL)
         return CAPSULE_ERROR_RUNTIME;
 
-    *result = Capsule_managed_pointer(handler, CAPSULE_DEALLOCATOR(dlclose));
+    *result = library_handle(handler);
+    return CAPSULE_ERROR_NONE;
+}
+
+/* returned strings belong to the callee, they are copied into the heap */
+static void foreign_result(CapsuleType type, Capsule* result) {
+    const char* s = result->as.symbol;
+
+    switch (type) {
+    case CAPSULE_TYPE_STRING:
+        *result = s ? CAPSULE_STRING(s) : Capsule_nil;
+        break;
+    case CAPSULE_TYPE_SYMBOL:
+        *result = s ? CAPSULE_SYMBOL(s) : Capsule_nil;
+        break;
+    default:
+        result->type = type;
+    }
+}
+
+/*
+ * Foreign signatures take the type keywords :INT :DEC :STR :SYM :PTR and the
+ * buffer views for C types narrower than the interpreter's, a NIL return type
+ * is void.
+ */
+typedef struct {
+    ffi_cif cif;
+    long return_type;
+    int count;
+    long types[MAX_FFI_FUN_ARGS];
+    ffi_type* ffi_types[MAX_FFI_FUN_ARGS];
+} ForeignSignature;
+
+static ffi_type* foreign_type(long type) {
+    switch (type) {
+    case CAPSULE_TYPE_SYMBOL:
+    case CAPSULE_TYPE_STRING:
+    case CAPSULE_TYPE_POINTER:
+        return &ffi_type_pointer;
+    case CAPSULE_TYPE_INTEGER:
+    case BUFFER_I64:
+        return &ffi_type_sint64;
+    case CAPSULE_TYPE_DECIMAL:
+    case BUFFER_F64:
+        return &ffi_type_double;
+    case BUFFER_U8:
+        return &ffi_type_uint8;
+    case BUFFER_I8:
+        return &ffi_type_sint8;
+    case BUFFER_U16:
+        return &ffi_type_uint16;
+    case BUFFER_I16:
+        return &ffi_type_sint16;
+    case BUFFER_U32:
+        return &ffi_type_uint32;
+    case BUFFER_I32:
+        return &ffi_type_sint32;
+    case BUFFER_U64:
+        return &ffi_type_uint64;
+    case BUFFER_F32:
+        return &ffi_type_float;
+    default:
+        return NULL;
+    }
+}
+
+static CapsuleError foreign_signature(Capsule return_type, Capsule types, ForeignSignature* sig) {
+    ffi_type* rtype = &ffi_type_void;
+
+    memset(sig, 0, sizeof(*sig));
+    if (!CAPSULE_NILP(return_type)) {
+        if (!CAPSULE_INTEGERP(return_type) || (rtype = foreign_type(return_type.as.integer)) == NULL)
+            return CAPSULE_ERROR_TYPE;
+        sig->return_type = return_type.as.integer;
+    }
+
+    for (; !CAPSULE_NILP(types); types = CAPSULE_CDR(types), sig->count++) {
+        Capsule type = CAPSULE_CAR(types);
+        if (sig->count == MAX_FFI_FUN_ARGS)
+            return CAPSULE_ERROR_ARGS;
+        if (!CAPSULE_INTEGERP(type) || (sig->ffi_types[sig->count] = foreign_type(type.as.integer)) == NULL)
+            return CAPSULE_ERROR_TYPE;
+        sig->types[sig->count] = type.as.integer;
+    }
+
+    if (ffi_prep_cif(&sig->cif, FFI_DEFAULT_ABI, sig->count, rtype, sig->ffi_types) != FFI_OK)
+        return CAPSULE_ERROR_RUNTIME;
+    return CAPSULE_ERROR_NONE;
+}
+
+/* stores VALUE as the C value of TYPE in HOLDER, for an argument or a callback's result */
+static CapsuleError foreign_to_c(long type, Capsule value, Capsule* holder) {
+    if (type >= BUFFER_U8)
+        return view_store(type, &holder->as, value);
+
+    if (value.type != type) {
+        if (type == CAPSULE_TYPE_DECIMAL && CAPSULE_INTEGERP(value))
+            value = CAPSULE_DECIMAL(CAPSULE_AS_INTEGER(value));
+        else if (type == CAPSULE_TYPE_POINTER && (CAPSULE_NILP(value) || CAPSULE_STRINGP(value)))
+            value.as.pointer = CAPSULE_NILP(value) ? NULL : value.as.pointer;
+        else
+            return CAPSULE_ERROR_TYPE;
+    }
+    holder->as = value.as;
+    return CAPSULE_ERROR_NONE;
+}
+
+/* the value of TYPE C stored at ELEMENT, for a result or a callback's argument */
+static CapsuleError foreign_from_c(long type, void* element, Capsule* result) {
+    if (type >= BUFFER_U8)
+        return view_load(type, element, result);
+
+    if (type == CAPSULE_TYPE_NIL) {
+        *result = Capsule_nil;
+        return CAPSULE_ERROR_NONE;
+    }
+    memcpy(&result->as, element, sizeof(result->as));
+    foreign_result(type, result);
+    return CAPSULE_ERROR_NONE;
+}
+
+/*
+ * A foreign function prepared once by FOREIGN-FUNCTION, a managed pointer
+ * that keeps its library loaded and is freed with the procedure calling it.
+ */
+typedef struct {
+    void* function;
+    ForeignSignature sig;
+} ForeignFunction;
+
+/* body of a foreign procedure, its data is the ForeignFunction */
+static CapsuleError foreign_call(Capsule args, Capsule scope, Capsule* result) {
+    Capsule data, values;
+    void* args_values[MAX_FFI_FUN_ARGS];
+    Capsule args_holder[MAX_FFI_FUN_ARGS];
+    CapsuleError error;
+    int i = 0;
+
+    if ((error = native_closure_args(args, scope, &data, &values)))
+        return error;
+
+    ForeignFunction* f = CAPSULE_AS_POINTER(data);
+    for (; !CAPSULE_NILP(values) && i < f->sig.count; values = CAPSULE_CDR(values), i++) {
+        if ((error = foreign_to_c(f->sig.types[i], CAPSULE_CAR(values), &args_holder[i])))
+            return error;
+        args_values[i] = &args_holder[i].as;
+    }
+    if (i != f->sig.count || !CAPSULE_NILP(values))
+        return CAPSULE_ERROR_ARGS;
+
+    /* narrow integer results are widened to a full ffi_arg */
+    union {
+        ffi_arg integer;
+        double decimal;
+        void* pointer;
+    } rvalue;
+    ffi_call(&f->sig.cif, FFI_FN(f->function), &rvalue, args_values);
+    return foreign_from_c(f->sig.return_type, &rvalue, result);
+}
+
+// ;(foreign-function "libm.so.6" "cos" :dec :dec)
+BUILTIN(foreignfunction) {
+    if (CAPSULE_NILP(args) || CAPSULE_NILP(CAPSULE_CDR(args)) || CAPSULE_NILP(CAPSULE_CDR(CAPSULE_CDR(args))))
+        return CAPSULE_ERROR_ARGS;
+
+    Capsule library = CAPSULE_CAR(args), name = CAPSULE_CAR(CAPSULE_CDR(args)), types = CAPSULE_CDR(CAPSULE_CDR(args));
+    void* handler = NULL;
+    CapsuleError error;
+
+    if (!CAPSULE_STRINGP(name))
+        return CAPSULE_ERROR_TYPE;
+
+    if (CAPSULE_STRINGP(library)) {
+        if ((handler = dlopen(CAPSULE_AS_STRING(library), RTLD_GLOBAL | RTLD_NOW)) == NULL) {
+            fprintf(stderr, "%s\n", dlerror());
+            return CAPSULE_ERROR_RUNTIME;
+        }
+        library = library_handle(handler);
+    } else if (CAPSULE_POINTERP(library)) {
+        handler = CAPSULE_AS_POINTER(library);
+    } else if (!CAPSULE_NILP(library)) {
+        return CAPSULE_ERROR_TYPE;
+    }
+
+    ForeignFunction* f = calloc(1, sizeof(ForeignFunction));
+    if (f == NULL)
+        return CAPSULE_ERROR_RUNTIME;
+    if ((error = foreign_signature(CAPSULE_CAR(types), CAPSULE_CDR(types), &f->sig))) {
+        free(f);
+        return error;
+    }
+    if ((f->function = dlsym(handler, CAPSULE_AS_STRING(name))) == NULL) {
+        fprintf(stderr, "%s\n", dlerror());
+        free(f);
+        return CAPSULE_ERROR_RUNTIME;
+    }
+
+    *result = native_closure(foreign_call, managed_pointer_new(f, free, f, library), scope);
+    return CAPSULE_ERROR_NONE;
+}
+
+/*
+ * A procedure C code calls through a libffi trampoline, on the thread
+ * running the interpreter. An invocation converts the arguments and applies
+ * PROC to them in a nested loop. The trampoline's address is a managed
+ * pointer that keeps PROC alive, C code must not keep it past the last
+ * reference from Lisp.
+ */
+typedef struct {
+    ffi_closure* closure;
+    ForeignSignature sig;
+    Capsule proc;
+} ForeignCallback;
+
+static void foreign_callback(ffi_cif* cif, void* ret, void** values, void* data) {
+    ForeignCallback* cb = data;
+    Capsule value = Capsule_nil, holder = {CAPSULE_TYPE_NIL}, argv[MAX_FFI_FUN_ARGS];
+    CapsuleError error = CAPSULE_ERROR_NONE;
+
+    (void)cif;
+    /* nothing is collected before the call has bound the converted arguments */
+    for (int i = 0; !error && i < cb->sig.count; i++)
+        error = foreign_from_c(cb->sig.types[i], values[i], &argv[i]);
+    if (!error)
+        error = Capsule_apply(cb->proc, cb->sig.count, argv, &value);
+    if (!error && cb->sig.return_type != CAPSULE_TYPE_NIL)
+        error = foreign_to_c(cb->sig.return_type, value, &holder);
+
+    /* an error can't unwind through the C frames, the callback returns zero */
+    if (error) {
+        fprintf(stderr, "ERROR: foreign callback failed: %s\n", Capsule_Error_str(error));
+        holder.as.integer = 0;
+    }
+    if (cb->sig.return_type != CAPSULE_TYPE_NIL)
+        memcpy(ret, &holder.as, sizeof(ffi_arg));
+}
+
+static void foreign_callback_free(void* data) {
+    ForeignCallback* cb = data;
+    ffi_closure_free(cb->closure);
+    free(cb);
+}
+
+// ;(foreign-callback (lambda (a b) ...) :i32 :ptr :ptr)
+BUILTIN(foreigncallback) {
+    if (CAPSULE_NILP(args) || CAPSULE_NILP(CAPSULE_CDR(args)))
+        return CAPSULE_ERROR_ARGS;
+
+    Capsule proc = CAPSULE_CAR(args), types = CAPSULE_CDR(args);
+    if (proc.type != CAPSULE_TYPE_CLOSURE && proc.type != CAPSULE_TYPE_BUILTIN)
+        return CAPSULE_ERROR_TYPE;
+
+    ForeignCallback* cb = calloc(1, sizeof(ForeignCallback));
+    CapsuleError error = foreign_signature(CAPSULE_CAR(types), CAPSULE_CDR(types), &cb->sig);
+    if (error) {
+        free(cb);
+        return error;
+    }
+
+    void* code = NULL;
+    if ((cb->closure = ffi_closure_alloc(sizeof(ffi_closure), &code)) == NULL) {
+        free(cb);
+        return CAPSULE_ERROR_RUNTIME;
+    }
+    if (ffi_prep_closure_loc(cb->closure, &cb->sig.cif, foreign_callback, cb, code) != FFI_OK) {
+        foreign_callback_free(cb);
+        return CAPSULE_ERROR_RUNTIME;
+    }
+
+    cb->proc = proc;
+
+    *result = managed_pointer_new(code, foreign_callback_free, cb, proc);
     return CAPSULE_ERROR_NONE;
 }
 
@@ -397,7 +1540,7 @@ BUILTIN(callcc) {
         return CAPSULE_ERROR_RUNTIME;
 
     ffi_call(&cif, FFI_FN(function), &result->as, args_values);
-    result->type = type;
+    foreign_result(type, result);
 
     if (handler && managed)
         dlclose(handler);
@@ -407,9 +1550,125 @@ BUILTIN(callcc) {
 
 #endif
 
+static const struct {
+    const char* symbol;
+    CapsuleBuiltin builtin;
+} BUILTINS[] = {
+    {"CAR", BUILTIN_ID(car)},
+    {"CDR", BUILTIN_ID(cdr)},
+    {"CONS", BUILTIN_ID(cons)},
+    {"SET-CAR!", BUILTIN_ID(setcar)},
+    {"SET-CDR!", BUILTIN_ID(setcdr)},
+    {"+", BUILTIN_ID(add)},
+    {"-", BUILTIN_ID(subtract)},
+    {"*", BUILTIN_ID(multiply)},
+    {"/", BUILTIN_ID(divide)},
+
+    {"<", BUILTIN_ID(less)},
+    {"EQ?", BUILTIN_ID(eq)},
+    {"PAIR?", BUILTIN_ID(pairp)},
+    {"PROCEDURE?", BUILTIN_ID(procp)},
+
+    {"REF", BUILTIN_ID(ref)},
+    {"WRITE", BUILTIN_ID(write)},
+    {"FLUSH", BUILTIN_ID(flush)},
+    {"SET-BUFFERING", BUILTIN_ID(setbuffering)},
+    {"READ", BUILTIN_ID(read)},
+    {"READ-LINE", BUILTIN_ID(readline)},
+    {"READ-BYTES", BUILTIN_ID(readbytes)},
+    {"READ-ALL", BUILTIN_ID(readall)},
+    {"FOR-EACH-LINE", BUILTIN_ID(foreachline)},
+    {"READ-CSV", BUILTIN_ID(readcsv)},
+    {"FOR-EACH-CSV", BUILTIN_ID(foreachcsv)},
+    {"WRITE-CSV", BUILTIN_ID(writecsv)},
+    {"READ-JSON", BUILTIN_ID(readjson)},
+    {"FOR-EACH-JSON", BUILTIN_ID(foreachjson)},
+    {"WRITE-JSON", BUILTIN_ID(writejson)},
+    {"READ-SOME", BUILTIN_ID(readsome)},
+    {"OPEN/PROCESS", BUILTIN_ID(popen)},
+    {"OPEN", BUILTIN_ID(open)},
+    {"CLOSE", BUILTIN_ID(close)},
+    {"COUNT", BUILTIN_ID(count)},
+    {"SLURP", BUILTIN_ID(slurp)},
+    {"EVAL", BUILTIN_ID(eval)},
+    {"LOAD-FILE", BUILTIN_ID(loadfile)},
+    {"REQUIRE", BUILTIN_ID(require)},
+    {"IMPORT", BUILTIN_ID(import)},
+    {"CURRENT-TIME-NS", BUILTIN_ID(currenttimens)},
+    {"CPU-TIME-NS", BUILTIN_ID(cputimens)},
+    {"RUNTIME-STATS", BUILTIN_ID(runtimestats)},
+    {"TIME-REPORT", BUILTIN_ID(timereport)},
+#ifdef EVAL_STATS
+    {"EVAL-STATS", BUILTIN_ID(evalstats)},
+#endif
+    {"PROFILE-START", BUILTIN_ID(profilestart)},
+    {"PROFILE-STOP", BUILTIN_ID(profilestop)},
+#ifdef PROFILE_ALLOC
+    {"ALLOCATION-PROFILE", BUILTIN_ID(allocationprofile)},
+#endif
+    {"TYPEOF", BUILTIN_ID(typeof)},
+
+    {"CALL-WITH-CURRENT-CONTINUATION", BUILTIN_ID(callcurrent)},
+    {"CALL-WITH-ESCAPE-CONTINUATION", BUILTIN_ID(callescape)},
+    {"CALL/EC", BUILTIN_ID(callescape)},
+
+    {"SPAWN", BUILTIN_ID(spawn)},
+    {"JOIN", BUILTIN_ID(join)},
+    {"YIELD", BUILTIN_ID(yield)},
+    {"SLEEP", BUILTIN_ID(sleep)},
+    {"AWAIT-READABLE", BUILTIN_ID(awaitreadable)},
+    {"AWAIT-WRITABLE", BUILTIN_ID(awaitwritable)},
+    {"MAKE-CHANNEL", BUILTIN_ID(makechannel)},
+    {"CHANNEL-SEND", BUILTIN_ID(channelsend)},
+    {"CHANNEL-RECEIVE", BUILTIN_ID(channelreceive)},
+    {"CHANNEL-CLOSE", BUILTIN_ID(channelclose)},
+
+    {"MAKE-BUFFER", BUILTIN_ID(makebuffer)},
+    {"BUFFER?", BUILTIN_ID(bufferp)},
+    {"BUFFER-SIZE", BUILTIN_ID(buffersize)},
+    {"BUFFER-REF", BUILTIN_ID(bufferref)},
+    {"BUFFER-SET!", BUILTIN_ID(bufferset)},
+    {"STRING->BUFFER", BUILTIN_ID(string2buffer)},
+    {"BUFFER->STRING", BUILTIN_ID(buffer2string)},
+    {"BUFFER->LIST", BUILTIN_ID(buffer2list)},
+    {"LIST->BUFFER", BUILTIN_ID(list2buffer)},
+    {"POINTER-REF", BUILTIN_ID(pointerref)},
+    {"POINTER-SET!", BUILTIN_ID(pointerset)},
+    {"STRUCT-LAYOUT", BUILTIN_ID(structlayout)},
+    {"STRUCT-REF", BUILTIN_ID(structref)},
+    {"STRUCT-SET!", BUILTIN_ID(structset)},
+
+    {"INT->DEC", BUILTIN_ID(i2d)},
+    {"DEC->INT", BUILTIN_ID(d2i)},
+
+#ifdef HAS_FFI
+    {"CALL/CC", BUILTIN_ID(callcc)},
+    {"FOREIGN-FUNCTION", BUILTIN_ID(foreignfunction)},
+    {"FOREIGN-CALLBACK", BUILTIN_ID(foreigncallback)},
+    {"LOAD-LIBRARY", BUILTIN_ID(loadlibrary)},
+#endif
+};
+
+#define BUILTINS_COUNT (sizeof(BUILTINS) / sizeof(BUILTINS[0]))
+
+const char* builtin_name(CapsuleBuiltin builtin) {
+    for (size_t i = 0; i < BUILTINS_COUNT; i++) {
+        if (BUILTINS[i].builtin == builtin)
+            return BUILTINS[i].symbol;
+    }
+    return NULL;
+}
+
+CapsuleBuiltin builtin_lookup(const char* symbol) {
+    for (size_t i = 0; i < BUILTINS_COUNT; i++) {
+        if (strcmp(BUILTINS[i].symbol, symbol) == 0)
+            return BUILTINS[i].builtin;
+    }
+    return NULL;
+}
+
 void define_builtin(Capsule scope) {
 #define DEFINE_VALUE(sym, value) Capsule_Scope_define(scope, CAPSULE_SYMBOL(sym), (value));
-#define DEFINE_BUILTIN(sym, id) DEFINE_VALUE(sym, CAPSULE_BUILTIN(BUILTIN_ID(id)));
 
     DEFINE_VALUE("T", CAPSULE_SYMBOL("T"))
 
@@ -417,32 +1676,9 @@ void define_builtin(Capsule scope) {
     DEFINE_VALUE("STDERR", CAPSULE_POINTER(stderr));
     DEFINE_VALUE("STDIN", CAPSULE_POINTER(stdin));
 
-    DEFINE_BUILTIN("CAR", car);
-    DEFINE_BUILTIN("CDR", cdr);
-    DEFINE_BUILTIN("CONS", cons);
-    DEFINE_BUILTIN("+", add);
-    DEFINE_BUILTIN("-", subtract);
-    DEFINE_BUILTIN("*", multiply);
-    DEFINE_BUILTIN("/", divide);
-
-    DEFINE_BUILTIN("<", less);
-    DEFINE_BUILTIN("EQ?", eq);
-    DEFINE_BUILTIN("PAIR?", pairp);
-    DEFINE_BUILTIN("PROCEDURE?", procp);
-
-    DEFINE_BUILTIN("REF", ref)
-    DEFINE_BUILTIN("WRITE", write)
-    DEFINE_BUILTIN("READ", read)
-    DEFINE_BUILTIN("OPEN/PROCESS", popen)
-    DEFINE_BUILTIN("OPEN", open)
-    DEFINE_BUILTIN("CLOSE", close)
-    DEFINE_BUILTIN("COUNT", count);
-    DEFINE_BUILTIN("SLURP", slurp);
-    DEFINE_BUILTIN("EVAL", eval);
-    DEFINE_BUILTIN("TYPEOF", typeof);
-
-    DEFINE_BUILTIN("INT->DEC", i2d)
-    DEFINE_BUILTIN("DEC->INT", d2i)
+    for (size_t i = 0; i < BUILTINS_COUNT; i++) {
+        DEFINE_VALUE(BUILTINS[i].symbol, CAPSULE_BUILTIN(BUILTINS[i].builtin));
+    }
 
     DEFINE_VALUE(":INT", CAPSULE_INTEGER(CAPSULE_TYPE_INTEGER));
     DEFINE_VALUE(":DEC", CAPSULE_INTEGER(CAPSULE_TYPE_DECIMAL));
@@ -450,8 +1686,18 @@ void define_builtin(Capsule scope) {
     DEFINE_VALUE(":SYM", CAPSULE_INTEGER(CAPSULE_TYPE_SYMBOL));
     DEFINE_VALUE(":PTR", CAPSULE_INTEGER(CAPSULE_TYPE_POINTER));
 
-#ifdef HAS_FFI
-    DEFINE_BUILTIN("CALL/CC", callcc)
-    DEFINE_BUILTIN("LOAD-LIBRARY", loadlibrary)
-#endif
-}
\ No newline at end of file
+    DEFINE_VALUE(":U8", CAPSULE_INTEGER(BUFFER_U8));
+    DEFINE_VALUE(":I8", CAPSULE_INTEGER(BUFFER_I8));
+    DEFINE_VALUE(":U16", CAPSULE_INTEGER(BUFFER_U16));
+    DEFINE_VALUE(":I16", CAPSULE_INTEGER(BUFFER_I16));
+    DEFINE_VALUE(":U32", CAPSULE_INTEGER(BUFFER_U32));
+    DEFINE_VALUE(":I32", CAPSULE_INTEGER(BUFFER_I32));
+    DEFINE_VALUE(":U64", CAPSULE_INTEGER(BUFFER_U64));
+    DEFINE_VALUE(":I64", CAPSULE_INTEGER(BUFFER_I64));
+    DEFINE_VALUE(":F32", CAPSULE_INTEGER(BUFFER_F32));
+    DEFINE_VALUE(":F64", CAPSULE_INTEGER(BUFFER_F64));
+
+    DEFINE_VALUE(":UNBUFFERED", CAPSULE_INTEGER(_IONBF));
+    DEFINE_VALUE(":LINE", CAPSULE_INTEGER(_IOLBF));
+    DEFINE_VALUE(":FULL", CAPSULE_INTEGER(_IOFBF));
+}
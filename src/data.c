@@ -0,0 +1,533 @@
+/*
+ * Copyright (c) 2024 Manjeet Singh <itsmanjeet1998@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * CSV and JSON streams
+ *
+ * Both readers pull characters straight from the stdio buffer and produce
+ * one record or value per call, so a file of any size is processed in
+ * constant memory by reading it record by record.
+ *
+ * A CSV record is a list of strings. JSON arrays become lists, objects
+ * association lists of (key . value) with string keys, true is T and both
+ * false and null are NIL. The writers take the same shapes back, a list
+ * whose elements all are pairs with a string key is written as an object.
+ */
+
+#include "priv.h"
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    char* data;
+    size_t size;
+    size_t capacity;
+} Buffer;
+
+static int buffer_push(Buffer* b, char c) {
+    if (b->size == b->capacity) {
+        size_t capacity = b->capacity ? b->capacity * 2 : 256;
+        char* data = realloc(b->data, capacity);
+        if (data == NULL)
+            return 0;
+        b->data = data;
+        b->capacity = capacity;
+    }
+    b->data[b->size++] = c;
+    return 1;
+}
+
+static Capsule buffer_string(Buffer* b) {
+    Capsule string;
+    memcpy(string_alloc(b->size, &string), b->data, b->size);
+    b->size = 0;
+    return string;
+}
+
+static void list_append(Capsule* head, Capsule* last, Capsule value) {
+    Capsule pair = CAPSULE_CONS(value, Capsule_nil);
+    if (CAPSULE_NILP(*head))
+        *head = pair;
+    else
+        CAPSULE_CDR(*last) = pair;
+    *last = pair;
+}
+
+/* field and string bytes are collected here, the buffer is kept for the next record */
+static Buffer scratch = {0};
+
+CapsuleError csv_read(FILE* file, Capsule* result) {
+    Capsule last = Capsule_nil;
+    int c;
+
+    /* blank lines carry no record */
+    while ((c = getc_unlocked(file)) == '\n' || c == '\r')
+        ;
+    if (c == EOF)
+        return ferror(file) ? CAPSULE_ERROR_RUNTIME : CAPSULE_ERROR_EOF;
+
+    *result = Capsule_nil;
+    scratch.size = 0;
+    for (;;) {
+        if (c == '"') {
+            for (;;) {
+                c = getc_unlocked(file);
+                if (c == EOF)
+                    return CAPSULE_ERROR_SYNTAX;
+                if (c == '"' && (c = getc_unlocked(file)) != '"')
+                    break;
+                if (!buffer_push(&scratch, c))
+                    return CAPSULE_ERROR_RUNTIME;
+            }
+        }
+
+        for (; c != ',' && c != '\n' && c != EOF; c = getc_unlocked(file)) {
+            if (c == '\r') {
+                if ((c = getc_unlocked(file)) == '\n')
+                    break;
+                ungetc(c, file);
+                c = '\r';
+            }
+            if (!buffer_push(&scratch, c))
+                return CAPSULE_ERROR_RUNTIME;
+        }
+
+        list_append(result, &last, buffer_string(&scratch));
+        if (c != ',')
+            return CAPSULE_ERROR_NONE;
+        c = getc_unlocked(file);
+    }
+}
+
+static void csv_write_field(FILE* file, const char* field) {
+    if (strpbrk(field, ",\"\r\n") == NULL) {
+        fputs(field, file);
+        return;
+    }
+
+    putc_unlocked('"', file);
+    for (const char* quote; (quote = strchr(field, '"')) != NULL; field = quote + 1) {
+        fwrite(field, sizeof(char), quote - field + 1, file);
+        putc_unlocked('"', file);
+    }
+    fputs(field, file);
+    putc_unlocked('"', file);
+}
+
+CapsuleError csv_write(FILE* file, Capsule record) {
+    for (Capsule iter = record; !CAPSULE_NILP(iter); iter = CAPSULE_CDR(iter)) {
+        if (iter.type != CAPSULE_TYPE_PAIR)
+            return CAPSULE_ERROR_TYPE;
+
+        Capsule field = CAPSULE_CAR(iter);
+        if (iter.as.pair != record.as.pair)
+            putc_unlocked(',', file);
+
+        switch (field.type) {
+        case CAPSULE_TYPE_NIL:
+            break;
+        case CAPSULE_TYPE_STRING:
+        case CAPSULE_TYPE_SYMBOL:
+            csv_write_field(file, field.as.symbol);
+            break;
+        case CAPSULE_TYPE_INTEGER:
+        case CAPSULE_TYPE_DECIMAL:
+            Capsule_print(field, file);
+            break;
+        default:
+            return CAPSULE_ERROR_TYPE;
+        }
+    }
+    putc_unlocked('\n', file);
+    return ferror(file) ? CAPSULE_ERROR_RUNTIME : CAPSULE_ERROR_NONE;
+}
+
+static int json_skip(FILE* file) {
+    int c;
+    while ((c = getc_unlocked(file)) == ' ' || c == '\n' || c == '\t' || c == '\r')
+        ;
+    return c;
+}
+
+static int json_hex(FILE* file) {
+    int value = 0;
+    for (int i = 0; i < 4; i++) {
+        int c = getc_unlocked(file);
+        if (c >= '0' && c <= '9')
+            value = value * 16 + c - '0';
+        else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+            value = value * 16 + (c | 0x20) - 'a' + 10;
+        else
+            return -1;
+    }
+    return value;
+}
+
+static int buffer_push_utf8(Buffer* b, unsigned codepoint) {
+    if (codepoint < 0x80)
+        return buffer_push(b, codepoint);
+    if (codepoint < 0x800)
+        return buffer_push(b, 0xC0 | codepoint >> 6) && buffer_push(b, 0x80 | (codepoint & 0x3F));
+    if (codepoint < 0x10000)
+        return buffer_push(b, 0xE0 | codepoint >> 12) && buffer_push(b, 0x80 | (codepoint >> 6 & 0x3F)) &&
+               buffer_push(b, 0x80 | (codepoint & 0x3F));
+    return buffer_push(b, 0xF0 | codepoint >> 18) && buffer_push(b, 0x80 | (codepoint >> 12 & 0x3F)) &&
+           buffer_push(b, 0x80 | (codepoint >> 6 & 0x3F)) && buffer_push(b, 0x80 | (codepoint & 0x3F));
+}
+
+/* the opening quote is already consumed */
+static CapsuleError json_string(FILE* file, Capsule* result) {
+    int c;
+
+    scratch.size = 0;
+    while ((c = getc_unlocked(file)) != '"') {
+        if (c == EOF)
+            return CAPSULE_ERROR_SYNTAX;
+
+        if (c == '\\') {
+            switch (c = getc_unlocked(file)) {
+            case 'b':
+                c = '\b';
+                break;
+            case 'f':
+                c = '\f';
+                break;
+            case 'n':
+                c = '\n';
+                break;
+            case 'r':
+                c = '\r';
+                break;
+            case 't':
+                c = '\t';
+                break;
+            case 'u': {
+                int codepoint = json_hex(file);
+                if (codepoint < 0)
+                    return CAPSULE_ERROR_SYNTAX;
+                if (codepoint >= 0xD800 && codepoint < 0xDC00) {
+                    int low;
+                    if (getc_unlocked(file) != '\\' || getc_unlocked(file) != 'u' || (low = json_hex(file)) < 0xDC00 || low > 0xDFFF)
+                        return CAPSULE_ERROR_SYNTAX;
+                    codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+                }
+                if (!buffer_push_utf8(&scratch, codepoint))
+                    return CAPSULE_ERROR_RUNTIME;
+                continue;
+            }
+            case '"':
+            case '\\':
+            case '/':
+                break;
+            default:
+                return CAPSULE_ERROR_SYNTAX;
+            }
+        }
+        if (!buffer_push(&scratch, c))
+            return CAPSULE_ERROR_RUNTIME;
+    }
+
+    *result = buffer_string(&scratch);
+    return CAPSULE_ERROR_NONE;
+}
+
+static CapsuleError json_number(FILE* file, int c, Capsule* result) {
+    char number[64];
+    size_t size = 0;
+    int decimal = 0;
+
+    for (; (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E'; c = getc_unlocked(file)) {
+        if (size == sizeof(number) - 1)
+            return CAPSULE_ERROR_SYNTAX;
+        decimal |= c == '.' || c == 'e' || c == 'E';
+        number[size++] = c;
+    }
+    ungetc(c, file);
+    number[size] = '\0';
+
+    char* end;
+    if (!decimal) {
+        long integer = strtol(number, &end, 10);
+        if (*end == '\0' && integer != LONG_MIN && integer != LONG_MAX) {
+            *result = CAPSULE_INTEGER(integer);
+            return CAPSULE_ERROR_NONE;
+        }
+    }
+
+    *result = CAPSULE_DECIMAL(strtod(number, &end));
+    return size && *end == '\0' ? CAPSULE_ERROR_NONE : CAPSULE_ERROR_SYNTAX;
+}
+
+static CapsuleError json_literal(FILE* file, const char* rest, Capsule value, Capsule* result) {
+    for (; *rest; rest++)
+        if (getc_unlocked(file) != *rest)
+            return CAPSULE_ERROR_SYNTAX;
+    *result = value;
+    return CAPSULE_ERROR_NONE;
+}
+
+typedef struct {
+    Capsule head;
+    Capsule last;
+    Capsule key;
+    int object;
+} JsonFrame;
+
+/*
+ * Nested containers are kept on an explicit stack of open lists, a value
+ * completes either the whole read or the innermost open container.
+ */
+static CapsuleError json_value(FILE* file, int c, Capsule* result) {
+    JsonFrame* stack = NULL;
+    size_t depth = 0, capacity = 0;
+    CapsuleError error = CAPSULE_ERROR_NONE;
+    Capsule value;
+
+    for (;;) {
+        switch (c) {
+        case '[':
+        case '{':
+            if (depth == capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                JsonFrame* grown = realloc(stack, capacity * sizeof(JsonFrame));
+                if (grown == NULL) {
+                    error = CAPSULE_ERROR_RUNTIME;
+                    goto exit;
+                }
+                stack = grown;
+            }
+            stack[depth++] = (JsonFrame){.head = Capsule_nil, .last = Capsule_nil, .object = c == '{'};
+
+            c = json_skip(file);
+            if (c == (stack[depth - 1].object ? '}' : ']')) {
+                value = Capsule_nil;
+                depth--;
+                break;
+            }
+            if (stack[depth - 1].object) {
+                if (c != '"' || (error = json_string(file, &stack[depth - 1].key)))
+                    goto syntax;
+                if (json_skip(file) != ':')
+                    goto syntax;
+                c = json_skip(file);
+            }
+            continue;
+        case '"':
+            if ((error = json_string(file, &value)))
+                goto exit;
+            break;
+        case 't':
+            error = json_literal(file, "rue", CAPSULE_SYMBOL("T"), &value);
+            break;
+        case 'f':
+            error = json_literal(file, "alse", Capsule_nil, &value);
+            break;
+        case 'n':
+            error = json_literal(file, "ull", Capsule_nil, &value);
+            break;
+        default:
+            if (c != '-' && (c < '0' || c > '9'))
+                goto syntax;
+            error = json_number(file, c, &value);
+            break;
+        }
+        if (error)
+            goto exit;
+
+        /* hand the value to the open containers, closing every one that ends here */
+        for (;;) {
+            if (depth == 0) {
+                *result = value;
+                goto exit;
+            }
+
+            JsonFrame* frame = &stack[depth - 1];
+            list_append(&frame->head, &frame->last, frame->object ? CAPSULE_CONS(frame->key, value) : value);
+
+            c = json_skip(file);
+            if (c == ',') {
+                c = json_skip(file);
+                if (frame->object) {
+                    if (c != '"' || (error = json_string(file, &frame->key)))
+                        goto syntax;
+                    if (json_skip(file) != ':')
+                        goto syntax;
+                    c = json_skip(file);
+                }
+                break;
+            }
+            if (c != (frame->object ? '}' : ']'))
+                goto syntax;
+            value = frame->head;
+            depth--;
+        }
+    }
+
+syntax:
+    if (!error)
+        error = CAPSULE_ERROR_SYNTAX;
+exit:
+    free(stack);
+    return error;
+}
+
+CapsuleError json_read(FILE* file, Capsule* result) {
+    int c = json_skip(file);
+    if (c == EOF)
+        return ferror(file) ? CAPSULE_ERROR_RUNTIME : CAPSULE_ERROR_EOF;
+    return json_value(file, c, result);
+}
+
+#define JSON_STREAM_START -1
+#define JSON_STREAM_VALUES 0
+#define JSON_STREAM_ARRAY 1
+#define JSON_STREAM_END 2
+
+void json_stream_init(JsonStream* stream, FILE* file) {
+    stream->file = file;
+    stream->state = JSON_STREAM_START;
+}
+
+/* the elements of a top level array one by one, otherwise the top level values in turn */
+CapsuleError json_stream_next(void* source, Capsule* result) {
+    JsonStream* stream = source;
+    if (stream->state == JSON_STREAM_END)
+        return CAPSULE_ERROR_EOF;
+
+    int c = json_skip(stream->file);
+    if (stream->state == JSON_STREAM_START) {
+        stream->state = c == '[' ? JSON_STREAM_ARRAY : JSON_STREAM_VALUES;
+        if (c == '[')
+            c = json_skip(stream->file);
+        else if (c == EOF)
+            return CAPSULE_ERROR_EOF;
+        if (c == ']') {
+            stream->state = JSON_STREAM_END;
+            return CAPSULE_ERROR_EOF;
+        }
+        return json_value(stream->file, c, result);
+    }
+
+    if (stream->state == JSON_STREAM_ARRAY) {
+        if (c == ']') {
+            stream->state = JSON_STREAM_END;
+            return CAPSULE_ERROR_EOF;
+        }
+        if (c != ',')
+            return CAPSULE_ERROR_SYNTAX;
+        c = json_skip(stream->file);
+    }
+
+    if (c == EOF)
+        return stream->state == JSON_STREAM_ARRAY ? CAPSULE_ERROR_SYNTAX : CAPSULE_ERROR_EOF;
+    return json_value(stream->file, c, result);
+}
+
+static void json_write_string(FILE* file, const char* string) {
+    putc_unlocked('"', file);
+    for (const char* span = string;; string++) {
+        unsigned char c = *string;
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        fwrite(span, sizeof(char), string - span, file);
+        if (c == '\0')
+            break;
+        switch (c) {
+        case '"':
+            fputs("\\\"", file);
+            break;
+        case '\\':
+            fputs("\\\\", file);
+            break;
+        case '\n':
+            fputs("\\n", file);
+            break;
+        case '\r':
+            fputs("\\r", file);
+            break;
+        case '\t':
+            fputs("\\t", file);
+            break;
+        default:
+            fprintf(file, "\\u%04x", c);
+        }
+        span = string + 1;
+    }
+    putc_unlocked('"', file);
+}
+
+static int json_objectp(Capsule list) {
+    for (; list.type == CAPSULE_TYPE_PAIR; list = CAPSULE_CDR(list))
+        if (CAPSULE_CAR(list).type != CAPSULE_TYPE_PAIR || !CAPSULE_STRINGP(CAPSULE_CAR(CAPSULE_CAR(list))))
+            return 0;
+    return 1;
+}
+
+CapsuleError json_write(FILE* file, Capsule value) {
+    CapsuleError error;
+
+    switch (value.type) {
+    case CAPSULE_TYPE_NIL:
+        fputs("null", file);
+        break;
+    case CAPSULE_TYPE_INTEGER:
+        Capsule_print(value, file);
+        break;
+    case CAPSULE_TYPE_DECIMAL:
+        if (isfinite(value.as.decimal))
+            Capsule_print(value, file);
+        else
+            fputs("null", file);
+        break;
+    case CAPSULE_TYPE_SYMBOL:
+        if (strcmp(value.as.symbol, "T") == 0) {
+            fputs("true", file);
+            break;
+        }
+        /* fall through */
+    case CAPSULE_TYPE_STRING:
+        json_write_string(file, value.as.symbol);
+        break;
+    case CAPSULE_TYPE_PAIR: {
+        int object = json_objectp(value);
+        putc_unlocked(object ? '{' : '[', file);
+        for (Capsule iter = value; !CAPSULE_NILP(iter); iter = CAPSULE_CDR(iter)) {
+            if (iter.type != CAPSULE_TYPE_PAIR)
+                return CAPSULE_ERROR_TYPE;
+            if (iter.as.pair != value.as.pair)
+                putc_unlocked(',', file);
+
+            Capsule item = CAPSULE_CAR(iter);
+            if (object) {
+                json_write_string(file, CAPSULE_CAR(item).as.symbol);
+                putc_unlocked(':', file);
+                item = CAPSULE_CDR(item);
+            }
+            if ((error = json_write(file, item)))
+                return error;
+        }
+        putc_unlocked(object ? '}' : ']', file);
+        break;
+    }
+    default:
+        return CAPSULE_ERROR_TYPE;
+    }
+    return ferror(file) ? CAPSULE_ERROR_RUNTIME : CAPSULE_ERROR_NONE;
+}
@@ -54,6 +54,34 @@ static Capsule make_frame(Capsule parent, Capsule env, Capsule tail) {
             env, CAPSULE_CONS(Capsule_nil, CAPSULE_CONS(tail, CAPSULE_CONS(Capsule_nil, CAPSULE_CONS(Capsule_nil, Capsule_nil))))));
 }
 
+/* escape continuations, see Continuations below */
+
+static Capsule escape_owner() {
+    return CAPSULE_POINTER(eval_state->task != NULL ? (void*)eval_state->task : (void*)eval_state);
+}
+
+/* the continuations die with the stack they were captured on */
+void escapes_clear(Capsule* escapes) {
+    for (; !CAPSULE_NILP(*escapes); *escapes = CAPSULE_CDR(*escapes))
+        CAPSULE_CAR(CAPSULE_CAR(*escapes)) = Capsule_nil;
+}
+
+/* ends the continuations captured since CELL, it included */
+static void escapes_pop(Capsule cell) {
+    Capsule* escapes = &eval_state->escapes;
+
+    if (CAPSULE_NILP(CAPSULE_CAR(cell)))
+        return;
+    while (!CAPSULE_NILP(*escapes)) {
+        Capsule top = CAPSULE_CAR(*escapes);
+
+        CAPSULE_CAR(top) = Capsule_nil;
+        *escapes = CAPSULE_CDR(*escapes);
+        if (top.as.pair == cell.as.pair)
+            break;
+    }
+}
+
 static int eval_do_exec(Capsule* stack, Capsule* expr, Capsule* env) {
     Capsule body;
 
@@ -61,6 +89,13 @@ static int eval_do_exec(Capsule* stack, Capsule* expr, Capsule* env) {
     body = Capsule_List_at(*stack, 5);
     *expr = CAPSULE_CAR(body);
     body = CAPSULE_CDR(body);
+#ifdef EVAL_STATS
+    /* a traced call keeps its frame through the last expression to report what it returns */
+    if (CAPSULE_NILP(body) && trace_hook != NULL) {
+        Capsule_List_set(*stack, 5, CAPSULE_INTEGER(0));
+        return CAPSULE_ERROR_NONE;
+    }
+#endif
     if (CAPSULE_NILP(body)) {
 
         *stack = CAPSULE_CAR(*stack);
@@ -80,8 +115,13 @@ static int eval_do_bind(Capsule* stack, Capsule* expr, Capsule* env) {
 
     op = Capsule_List_at(*stack, 2);
     args = Capsule_List_at(*stack, 4);
+    EVAL_COUNT(closure_calls);
+    EVAL_TRACE(CAPSULE_TRACE_APPLY, op, args);
 
     *env = Capsule_Scope_new(CAPSULE_CAR(op));
+    /* the closure a sample attributes this scope to, kept behind the parameters */
+    if (PROFILE_SCOPES)
+        CAPSULE_CDR(*env) = CAPSULE_CONS(CAPSULE_CONS(profile_marker, op), Capsule_nil);
     arg_names = CAPSULE_CAR(CAPSULE_CDR(op));
     body = CAPSULE_CDR(CAPSULE_CDR(op));
     Capsule_List_set(*stack, 1, *env);
@@ -152,6 +192,14 @@ static int eval_do_return(Capsule* stack, Capsule* expr, Capsule* env, Capsule*
     op = Capsule_List_at(*stack, 2);
     body = Capsule_List_at(*stack, 5);
 
+#ifdef EVAL_STATS
+    if (body.type == CAPSULE_TYPE_INTEGER) {
+        EVAL_TRACE(CAPSULE_TRACE_RETURN, op, *result);
+        *stack = CAPSULE_CAR(*stack);
+        *expr = CAPSULE_CONS(CAPSULE_SYMBOL("QUOTE"), CAPSULE_CONS(*result, Capsule_nil));
+        return CAPSULE_ERROR_NONE;
+    }
+#endif
     if (!CAPSULE_NILP(body)) {
         return eval_do_apply(stack, expr, env, result);
     }
@@ -163,6 +211,7 @@ static int eval_do_return(Capsule* stack, Capsule* expr, Capsule* env, Capsule*
 
         if (op.type == CAPSULE_TYPE_MACRO) {
 
+            EVAL_COUNT(macro_expansions);
             args = Capsule_List_at(*stack, 3);
             *stack = make_frame(*stack, *env, Capsule_nil);
             op.type = CAPSULE_TYPE_CLOSURE;
@@ -175,6 +224,7 @@ static int eval_do_return(Capsule* stack, Capsule* expr, Capsule* env, Capsule*
         if (strcmp(op.as.symbol, "DEFINE") == 0) {
             Capsule sym = Capsule_List_at(*stack, 4);
             (void)Capsule_Scope_define(*env, sym, *result);
+            profile_define(sym, *result);
             *stack = CAPSULE_CAR(*stack);
             *expr = CAPSULE_CONS(CAPSULE_SYMBOL("QUOTE"), CAPSULE_CONS(sym, Capsule_nil));
             return CAPSULE_ERROR_NONE;
@@ -193,6 +243,12 @@ static int eval_do_return(Capsule* stack, Capsule* expr, Capsule* env, Capsule*
             *expr = CAPSULE_CONS(CAPSULE_SYMBOL("BEGIN"), args);
             *stack = CAPSULE_CAR(*stack);
             return CAPSULE_ERROR_NONE;
+        } else if (strcmp(op.as.symbol, "CALL/EC") == 0) {
+            /* an escape continuation's marker, the value passes through and the continuation dies */
+            escapes_pop(Capsule_List_at(*stack, 3));
+            *stack = CAPSULE_CAR(*stack);
+            *expr = CAPSULE_CONS(CAPSULE_SYMBOL("QUOTE"), CAPSULE_CONS(*result, Capsule_nil));
+            return CAPSULE_ERROR_NONE;
         } else {
             goto store_arg;
         }
@@ -218,21 +274,167 @@ static int eval_do_return(Capsule* stack, Capsule* expr, Capsule* env, Capsule*
     return CAPSULE_ERROR_NONE;
 }
 
-CapsuleError Capsule_eval_cap(Capsule expr, Capsule scope, Capsule* result) {
+EvalState* eval_state = NULL;
+
+#ifdef EVAL_STATS
+CapsuleStats eval_stats;
+CapsuleTraceHook trace_hook = NULL;
+void* trace_data = NULL;
+#endif
+
+CapsuleError Capsule_stats(CapsuleStats* stats) {
+#ifdef EVAL_STATS
+    *stats = eval_stats;
+    return CAPSULE_ERROR_NONE;
+#else
+    memset(stats, 0, sizeof(*stats));
+    return CAPSULE_ERROR_RUNTIME;
+#endif
+}
+
+void Capsule_stats_reset() {
+#ifdef EVAL_STATS
+    memset(&eval_stats, 0, sizeof(eval_stats));
+#endif
+}
+
+CapsuleError Capsule_trace(CapsuleTraceHook hook, void* data) {
+#ifdef EVAL_STATS
+    trace_hook = hook;
+    trace_data = data;
+    return CAPSULE_ERROR_NONE;
+#else
+    (void)hook;
+    (void)data;
+    return CAPSULE_ERROR_RUNTIME;
+#endif
+}
+
+/*
+ * Continuations
+ *
+ * Frames are updated in place as evaluation goes on, so a full continuation
+ * keeps a private copy of the frames it captured and re-enters with a fresh
+ * copy each time. An escape continuation only points at a marker frame, it
+ * can unwind to it while the marker is still on the running stack.
+ *
+ * The marker holds a cell whose car names the task running it, the loop keeps
+ * the live cells innermost first and empties each one as its marker leaves
+ * the stack, by returning, by an escape past it or by an error. Resuming an
+ * escape only looks at its cell.
+ */
+
+static Capsule stack_copy(Capsule stack) {
+    Capsule copy = Capsule_nil, last = Capsule_nil;
+
+    for (; !CAPSULE_NILP(stack); stack = CAPSULE_CAR(stack)) {
+        Capsule frame = Capsule_List_clone(stack);
+        Capsule args = Capsule_List_at(frame, 4);
+
+        /* evaluated arguments are reversed in place when applied */
+        if (args.type == CAPSULE_TYPE_PAIR)
+            Capsule_List_set(frame, 4, Capsule_List_clone(args));
+        if (CAPSULE_NILP(last))
+            copy = frame;
+        else
+            CAPSULE_CAR(last) = frame;
+        last = frame;
+    }
+    return copy;
+}
+
+/* a procedure whose body calls BUILTIN with DATA and the list of values it was applied to */
+Capsule native_closure(CapsuleBuiltin builtin, Capsule data, Capsule scope) {
+    Capsule params = CAPSULE_SYMBOL("VALUES"), call, closure;
+
+    call = CAPSULE_CONS(CAPSULE_BUILTIN(builtin), CAPSULE_CONS(data, CAPSULE_CONS(params, Capsule_nil)));
+    make_closure(scope, params, CAPSULE_CONS(call, Capsule_nil), &closure);
+    return closure;
+}
+
+/* the builtin of a native closure gets its arguments unevaluated, the values are bound in SCOPE */
+CapsuleError native_closure_args(Capsule args, Capsule scope, Capsule* data, Capsule* values) {
+    *data = CAPSULE_CAR(args);
+    return Capsule_Scope_lookup(scope, CAPSULE_CAR(CAPSULE_CDR(args)), values);
+}
+
+/* body of a continuation's procedure, its data is the captured (cell . stack), nil for a full continuation */
+static CapsuleError continuation_resume(Capsule args, Capsule scope, Capsule* result) {
+    Capsule data, cell, target, values;
+    Capsule* stack = eval_state->stack;
+    CapsuleError error;
+
+    if ((error = native_closure_args(args, scope, &data, &values)))
+        return error;
+    cell = CAPSULE_CAR(data);
+    target = CAPSULE_CDR(data);
+    *result = CAPSULE_NILP(values) ? Capsule_nil : CAPSULE_CAR(values);
+
+    if (CAPSULE_NILP(cell)) {
+        escapes_clear(&eval_state->escapes);
+        *stack = stack_copy(target);
+        return CAPSULE_ERROR_NONE;
+    }
+
+    /* a live cell belongs to the task running and its marker is still on the stack */
+    if (CAPSULE_NILP(CAPSULE_CAR(cell)) || CAPSULE_CAR(cell).as.pointer != escape_owner().as.pointer) {
+        fprintf(stderr, "Escape continuation used outside of its extent\n");
+        return CAPSULE_ERROR_RUNTIME;
+    }
+
+    /* the marker stays, it passes the value on and ends the continuation */
+    while (CAPSULE_CAR(eval_state->escapes).as.pair != cell.as.pair) {
+        CAPSULE_CAR(CAPSULE_CAR(eval_state->escapes)) = Capsule_nil;
+        eval_state->escapes = CAPSULE_CDR(eval_state->escapes);
+    }
+    *stack = target;
+    return CAPSULE_ERROR_NONE;
+}
+
+/* called from a builtin, the running loop's stack is the continuation of that call */
+CapsuleError eval_capture(Capsule proc, int escape, Capsule scope, Capsule* result) {
+    Capsule* stack = eval_state->stack;
+    Capsule data, cell, k;
+
+    if (escape) {
+        /* the cell sits where the marker's arguments would, stack_copy keeps it shared */
+        cell = CAPSULE_CONS(escape_owner(), Capsule_nil);
+        eval_state->escapes = CAPSULE_CONS(cell, eval_state->escapes);
+        *stack = make_frame(*stack, scope, cell);
+        Capsule_List_set(*stack, 2, CAPSULE_SYMBOL("CALL/EC"));
+        data = CAPSULE_CONS(cell, *stack);
+    } else {
+        data = CAPSULE_CONS(Capsule_nil, stack_copy(*stack));
+    }
+
+    k = native_closure(continuation_resume, data, scope);
+
+    /* a frame with PROC as its operator and K left to evaluate, the loop applies it with the result */
+    *stack = make_frame(*stack, scope, CAPSULE_CONS(k, Capsule_nil));
+    *result = proc;
+    return CAPSULE_ERROR_NONE;
+}
+
+static CapsuleError eval(Capsule expr, Capsule scope, Capsule stack, Capsule* result, EvalState* state) {
     static int count = 0;
     CapsuleError error = CAPSULE_ERROR_NONE;
-    Capsule stack = Capsule_nil;
+
+    state->expr = &expr;
+    state->scope = &scope;
+    state->stack = &stack;
 
     do {
+        runtime_stats.steps++;
+        EVAL_COUNT(steps);
         if (++count >= GC_THRESHOLD) {
-            gc_mark(expr);
-            gc_mark(scope);
-            gc_mark(stack);
             gc();
             count = 0;
         }
+        if (profile_pending)
+            profile_sample();
 
         if (expr.type == CAPSULE_TYPE_SYMBOL) {
+            EVAL_COUNT(lookups);
             error = Capsule_Scope_lookup(scope, expr, result);
             if (error == CAPSULE_ERROR_UNBOUND) {
                 fprintf(stderr, "Unbound symbol %s\n", expr.as.symbol);
@@ -245,22 +447,16 @@ CapsuleError Capsule_eval_cap(Capsule expr, Capsule scope, Capsule* result) {
             Capsule op = CAPSULE_CAR(expr);
             Capsule args = CAPSULE_CDR(expr);
 
-            // fprintf(stdout, "OP: ");
-            // Capsule_print(op, stdout);
-            // fprintf(stdout, "\n");
-            //
-            // fprintf(stdout, "ARGS: ");
-            // Capsule_print(args, stdout);
-            // fprintf(stdout, "\n");
-
             if (op.type == CAPSULE_TYPE_SYMBOL) {
 
                 if (strcmp(op.as.symbol, "QUOTE") == 0) {
+                    EVAL_COUNT(forms[CAPSULE_FORM_QUOTE]);
                     if (CAPSULE_NILP(args) || !CAPSULE_NILP(CAPSULE_CDR(args)))
                         return CAPSULE_ERROR_ARGS;
 
                     *result = CAPSULE_CAR(args);
                 } else if (strcmp(op.as.symbol, "DEFINE") == 0) {
+                    EVAL_COUNT(forms[CAPSULE_FORM_DEFINE]);
                     Capsule sym;
 
                     if (CAPSULE_NILP(args) || CAPSULE_NILP(CAPSULE_CDR(args)))
@@ -273,6 +469,7 @@ CapsuleError Capsule_eval_cap(Capsule expr, Capsule scope, Capsule* result) {
                         if (sym.type != CAPSULE_TYPE_SYMBOL)
                             return CAPSULE_ERROR_TYPE;
                         (void)Capsule_Scope_define(scope, sym, *result);
+                        profile_define(sym, *result);
                         *result = sym;
                     } else if (sym.type == CAPSULE_TYPE_SYMBOL) {
                         if (!CAPSULE_NILP(CAPSULE_CDR(CAPSULE_CDR(args))))
@@ -286,18 +483,25 @@ CapsuleError Capsule_eval_cap(Capsule expr, Capsule scope, Capsule* result) {
                         return CAPSULE_ERROR_TYPE;
                     }
                 } else if (strcmp(op.as.symbol, "LAMBDA") == 0) {
+                    EVAL_COUNT(forms[CAPSULE_FORM_LAMBDA]);
                     if (CAPSULE_NILP(args) || CAPSULE_NILP(CAPSULE_CDR(args)))
                         return CAPSULE_ERROR_ARGS;
 
                     error = make_closure(scope, CAPSULE_CAR(args), CAPSULE_CDR(args), result);
                 } else if (CAPSULE_SYMBOL_COMPARE(op, "BEGIN")) {
-                    if (!CAPSULE_NILP(args)) {
+                    EVAL_COUNT(forms[CAPSULE_FORM_BEGIN]);
+                    /* the last expression is a tail call, loops written with BEGIN run in constant space */
+                    if (!CAPSULE_NILP(args) && CAPSULE_NILP(CAPSULE_CDR(args))) {
+                        expr = CAPSULE_CAR(args);
+                        continue;
+                    } else if (!CAPSULE_NILP(args)) {
                         stack = make_frame(stack, scope, CAPSULE_CDR(args));
                         Capsule_List_set(stack, 2, op);
                         expr = CAPSULE_CAR(args);
                         continue;
                     }
                 } else if (strcmp(op.as.symbol, "IF") == 0) {
+                    EVAL_COUNT(forms[CAPSULE_FORM_IF]);
                     if (CAPSULE_NILP(args) || CAPSULE_NILP(CAPSULE_CDR(args)) || CAPSULE_NILP(CAPSULE_CDR(CAPSULE_CDR(args))) ||
                         !CAPSULE_NILP(CAPSULE_CDR(CAPSULE_CDR(CAPSULE_CDR(args)))))
                         return CAPSULE_ERROR_ARGS;
@@ -307,6 +511,7 @@ CapsuleError Capsule_eval_cap(Capsule expr, Capsule scope, Capsule* result) {
                     expr = CAPSULE_CAR(args);
                     continue;
                 } else if (strcmp(op.as.symbol, "DEFMACRO") == 0) {
+                    EVAL_COUNT(forms[CAPSULE_FORM_DEFMACRO]);
                     Capsule name, macro;
 
                     if (CAPSULE_NILP(args) || CAPSULE_NILP(CAPSULE_CDR(args)))
@@ -324,8 +529,10 @@ CapsuleError Capsule_eval_cap(Capsule expr, Capsule scope, Capsule* result) {
                         macro.type = CAPSULE_TYPE_MACRO;
                         *result = name;
                         (void)Capsule_Scope_define(scope, name, macro);
+                        profile_define(name, macro);
                     }
                 } else if (strcmp(op.as.symbol, "APPLY") == 0) {
+                    EVAL_COUNT(forms[CAPSULE_FORM_APPLY]);
                     if (CAPSULE_NILP(args) || CAPSULE_NILP(CAPSULE_CDR(args)) || !CAPSULE_NILP(CAPSULE_CDR(CAPSULE_CDR(args))))
                         return CAPSULE_ERROR_ARGS;
 
@@ -334,6 +541,7 @@ CapsuleError Capsule_eval_cap(Capsule expr, Capsule scope, Capsule* result) {
                     expr = CAPSULE_CAR(args);
                     continue;
                 } else if (strcmp(op.as.symbol, "SET!") == 0) {
+                    EVAL_COUNT(forms[CAPSULE_FORM_SET]);
                     if (CAPSULE_NILP(args) || CAPSULE_NILP(CAPSULE_CDR(args)) || !CAPSULE_NILP(CAPSULE_CDR(CAPSULE_CDR(args))))
                         return CAPSULE_ERROR_ARGS;
                     if (CAPSULE_CAR(args).type != CAPSULE_TYPE_SYMBOL)
@@ -347,8 +555,16 @@ CapsuleError Capsule_eval_cap(Capsule expr, Capsule scope, Capsule* result) {
                     goto push;
                 }
             } else if (op.type == CAPSULE_TYPE_BUILTIN) {
-                if ((error = (*op.as.builtin)(args, scope, result))) {
+                EVAL_COUNT(builtin_calls);
+                EVAL_TRACE(CAPSULE_TRACE_APPLY, op, args);
+                error = (*op.as.builtin)(args, scope, result);
+                /* the builtin blocked, go on with whichever task can run */
+                if (!error && state->suspended) {
+                    error = sched_switch(state, &stack, &scope, &expr);
+                    continue;
                 }
+                if (!error)
+                    EVAL_TRACE(CAPSULE_TRACE_RETURN, op, *result);
             } else {
             push:
 
@@ -358,21 +574,200 @@ CapsuleError Capsule_eval_cap(Capsule expr, Capsule scope, Capsule* result) {
             }
         }
 
-        if (CAPSULE_NILP(stack))
-            break;
+        if (CAPSULE_NILP(stack)) {
+            if (state->task == NULL || error)
+                break;
+            /* a spawned task returned, the loop itself is not done yet */
+            error = sched_finish(state, &stack, &scope, &expr);
+            continue;
+        }
 
         if (!error)
             error = eval_do_return(&stack, &expr, &scope, result);
     } while (!error);
 
+    return error;
+}
+
+/* runs the loop from EXPR with STACK as its continuation, nil for a new evaluation */
+static CapsuleError eval_run(Capsule expr, Capsule scope, Capsule stack, Capsule* result) {
+    EvalState state = {.result = result, .parent = eval_state};
+    CapsuleError error;
+
+    *result = Capsule_nil;
+    eval_state = &state;
+    /* an error only ends the task raising it, the loop carries on with the next one */
+    while ((error = eval(expr, scope, stack, result, &state)) && state.task != NULL) {
+        state.expr = &expr;
+        state.scope = &scope;
+        state.stack = &stack;
+        if ((error = sched_fail(&state, error, &stack, &scope, &expr)))
+            break;
+    }
+    escapes_clear(&state.escapes);
+    sched_leave(&state);
+    eval_state = state.parent;
+
+    return error;
+}
+
+CapsuleError Capsule_eval_cap(Capsule expr, Capsule scope, Capsule* result) {
+    return eval_run(expr, scope, Capsule_nil, result);
+}
+
+/*
+ * Calls from C
+ *
+ * A closure's parameters are bound from the argument array into a new
+ * scope and the loop starts on its body with the call frame as the only
+ * one on the stack, no call expression is built or evaluated. Builtins
+ * take their arguments as a list and are applied through the loop so a
+ * blocking one can still suspend.
+ */
+
+static Capsule values_list(size_t argc, const Capsule* argv) {
+    Capsule list = Capsule_nil;
+
+    while (argc > 0)
+        list = CAPSULE_CONS(argv[--argc], list);
+    return list;
+}
+
+/* the frame eval_do_bind would have made for the call, with the first body expression in EXPR */
+static CapsuleError apply_frame(Capsule closure, size_t argc, const Capsule* argv, Capsule* stack, Capsule* expr, Capsule* env) {
+    Capsule params = CAPSULE_CAR(CAPSULE_CDR(closure)), body = CAPSULE_CDR(CAPSULE_CDR(closure));
+    size_t i = 0;
+
+    EVAL_COUNT(closure_calls);
+    EVAL_TRACE(CAPSULE_TRACE_APPLY, closure, values_list(argc, argv));
+
+    *env = Capsule_Scope_new(CAPSULE_CAR(closure));
+    if (PROFILE_SCOPES)
+        CAPSULE_CDR(*env) = CAPSULE_CONS(CAPSULE_CONS(profile_marker, closure), Capsule_nil);
+    for (; params.type == CAPSULE_TYPE_PAIR; params = CAPSULE_CDR(params), i++) {
+        if (i == argc)
+            return CAPSULE_ERROR_ARGS;
+        Capsule_Scope_define(*env, CAPSULE_CAR(params), argv[i]);
+    }
+    if (params.type == CAPSULE_TYPE_SYMBOL)
+        Capsule_Scope_define(*env, params, values_list(argc - i, argv + i));
+    else if (i != argc)
+        return CAPSULE_ERROR_ARGS;
+
+    /* a body of one expression runs without the frame, eval_do_exec would drop it right away */
+    *stack = Capsule_nil;
+    *expr = CAPSULE_CAR(body);
+    if (CAPSULE_NILP(CAPSULE_CDR(body)) && !EVAL_TRACING)
+        return CAPSULE_ERROR_NONE;
+
+    *stack = make_frame(Capsule_nil, *env, Capsule_nil);
+    Capsule_List_set(*stack, 2, closure);
+    Capsule_List_set(*stack, 5, body);
+    return eval_do_exec(stack, expr, env);
+}
+
+CapsuleError Capsule_apply(Capsule fn, size_t argc, const Capsule* argv, Capsule* result) {
+    Capsule stack, expr, scope;
+    CapsuleError error;
+
+    *result = Capsule_nil;
+    if (fn.type == CAPSULE_TYPE_BUILTIN)
+        return eval_run(CAPSULE_CONS(fn, values_list(argc, argv)), Capsule_Scope_global(), Capsule_nil, result);
+    if (fn.type != CAPSULE_TYPE_CLOSURE)
+        return CAPSULE_ERROR_TYPE;
+
+    /* nothing is collected before the loop roots the frame */
+    if ((error = apply_frame(fn, argc, argv, &stack, &expr, &scope)))
+        return error;
+    return eval_run(expr, scope, stack, result);
+}
+
+CapsuleError Capsule_apply_batch(Capsule fn, size_t count, size_t argc, const Capsule* argv, Capsule* results) {
+    Capsule kept = Capsule_nil, stack = Capsule_nil, value = Capsule_nil;
+    /* results on the heap stay rooted while the next calls run, most handlers return immediates */
+    EvalState state = {.expr = &kept, .scope = &fn, .stack = &stack, .result = &value, .parent = eval_state};
+    CapsuleError error = CAPSULE_ERROR_NONE;
+
+    if (fn.type != CAPSULE_TYPE_BUILTIN && fn.type != CAPSULE_TYPE_CLOSURE)
+        return CAPSULE_ERROR_TYPE;
+
+    eval_state = &state;
+    for (size_t i = 0; i < count; i++)
+        results[i] = Capsule_nil;
+    for (size_t i = 0; i < count && !error; i++) {
+        /* the tuples not applied yet, the current one is bound by the time anything is collected */
+        state.values = argv + (i + 1) * argc;
+        state.count = (count - i - 1) * argc;
+        if (!(error = Capsule_apply(fn, argc, argv + i * argc, &results[i])) && gc_collectablep(results[i]))
+            kept = CAPSULE_CONS(results[i], kept);
+    }
+    eval_state = state.parent;
 
     return error;
 }
 
+/* evaluates forms as they are read, the previous forms are garbage by the time the next one is read */
+CapsuleError eval_forms(FormSource next, void* source, Capsule scope, Capsule* result) {
+    Capsule form = Capsule_nil, stack = Capsule_nil;
+    EvalState state = {.expr = &form, .scope = &scope, .stack = &stack, .result = result, .parent = eval_state};
+    CapsuleError error;
+
+    *result = Capsule_nil;
+    eval_state = &state;
+    while (!(error = next(source, &form))) {
+        if ((error = Capsule_eval_cap(form, scope, result)))
+            break;
+        form = Capsule_nil;
+        gc_maybe();
+    }
+    /* the outermost evaluation waits for the tasks it spawned */
+    if (error == CAPSULE_ERROR_EOF && state.parent == NULL)
+        error = sched_run(scope);
+    eval_state = state.parent;
+
+    return error == CAPSULE_ERROR_EOF ? CAPSULE_ERROR_NONE : error;
+}
+
+static CapsuleError reader_next(void* reader, Capsule* result) {
+    return Capsule_Reader_next(reader, result);
+}
+
 CapsuleError Capsule_eval(const char* source, Capsule scope, Capsule* result) {
+    CapsuleReader reader;
+    Capsule_Reader_init_buffer(&reader, source);
+    return eval_forms(reader_next, &reader, scope, result);
+}
+
+/* regular files are read straight from a mapping, through the .capc cache when CACHE is set */
+CapsuleError load_file(const char* path, int cache, Capsule scope, Capsule* result) {
+    CapsuleReader reader;
     CapsuleError error;
-    Capsule capsule;
-    if ((error = Capsule_read(source, &capsule)))
+    size_t size, length;
+
+    char* source = map_file(path, 0, &size, &length);
+    if (source != NULL) {
+        if (cache) {
+            error = fasl_eval(path, source, size, scope, result);
+        } else {
+            Capsule_Reader_init_buffer(&reader, source);
+            error = eval_forms(reader_next, &reader, scope, result);
+        }
+        unmap_file(source, length);
         return error;
-    return Capsule_eval_cap(capsule, scope, result);
-}
\ No newline at end of file
+    }
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return CAPSULE_ERROR_RUNTIME;
+
+    Capsule_Reader_init_file(&reader, file);
+    error = eval_forms(reader_next, &reader, scope, result);
+    Capsule_Reader_close(&reader);
+    fclose(file);
+
+    return error;
+}
+
+CapsuleError Capsule_load(const char* path, Capsule scope, Capsule* result) {
+    return load_file(path, 0, scope, result);
+}
@@ -0,0 +1,421 @@
+/*
+ * Copyright (c) 2024 Manjeet Singh <itsmanjeet1998@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * FASL, pre-read forms cached next to their source
+ *
+ * A .capc file is a header identifying the source (mtime, size and hash)
+ * followed by the forms of the file, each a tag byte and its payload.
+ * Integers are zigzag varints, decimals raw host doubles and lists a count,
+ * the elements and the tail. The first use of a symbol in the file carries
+ * its name and later uses only its index in the file's symbol table.
+ *
+ * On a miss each form is written to an unnamed file as it is read, then
+ * evaluated. The file gets its name once the last form has run without
+ * error, a process that dies or a source that fails on the way leaves
+ * nothing behind.
+ */
+
+/* O_TMPFILE */
+#define _GNU_SOURCE
+
+#include "priv.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FASL_MAGIC "CAPSULEC"
+#define FASL_VERSION 1
+#define FASL_EXTENSION ".capc"
+
+typedef enum {
+    FASL_NIL,
+    FASL_LIST,
+    FASL_INTEGER,
+    FASL_DECIMAL,
+    FASL_STRING,
+    FASL_SYMBOL,
+    FASL_SYMBOL_REF,
+} FaslTag;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;
+    uint64_t hash;
+} FaslHeader;
+
+typedef struct {
+    FILE* out;
+    const char** keys;
+    uint64_t* values;
+    size_t capacity;
+    size_t count;
+} FaslWriter;
+
+typedef struct {
+    const unsigned char* position;
+    const unsigned char* end;
+    Capsule* symbols;
+    size_t count;
+    size_t capacity;
+} FaslReader;
+
+static uint64_t source_hash(const char* source, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    size_t i = 0;
+
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, source + i, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ull;
+        hash ^= hash >> 32;
+    }
+    for (; i < size; i++)
+        hash = (hash ^ (unsigned char)source[i]) * 1099511628211ull;
+    return hash;
+}
+
+static void write_varint(FILE* out, uint64_t value) {
+    while (value >= 0x80) {
+        putc((value & 0x7F) | 0x80, out);
+        value >>= 7;
+    }
+    putc(value, out);
+}
+
+static size_t writer_slot(FaslWriter* w, const char* key) {
+    size_t i = ((uintptr_t)key >> 3) * 11400714819323198485ull & (w->capacity - 1);
+    while (w->keys[i] != NULL && w->keys[i] != key)
+        i = (i + 1) & (w->capacity - 1);
+    return i;
+}
+
+static int writer_grow(FaslWriter* w) {
+    FaslWriter old = *w;
+
+    w->capacity = old.capacity ? old.capacity * 2 : 256;
+    w->keys = calloc(w->capacity, sizeof(*w->keys));
+    w->values = malloc(w->capacity * sizeof(*w->values));
+    if (w->keys == NULL || w->values == NULL)
+        return 0;
+
+    for (size_t i = 0; i < old.capacity; i++) {
+        if (old.keys[i] != NULL) {
+            size_t slot = writer_slot(w, old.keys[i]);
+            w->keys[slot] = old.keys[i];
+            w->values[slot] = old.values[i];
+        }
+    }
+    free(old.keys);
+    free(old.values);
+    return 1;
+}
+
+/* symbols are interned so the name pointer identifies them */
+static int write_symbol(FaslWriter* w, const char* symbol) {
+    if ((w->count + 1) * 2 > w->capacity && !writer_grow(w))
+        return 0;
+
+    size_t slot = writer_slot(w, symbol);
+    if (w->keys[slot] != NULL) {
+        putc(FASL_SYMBOL_REF, w->out);
+        write_varint(w->out, w->values[slot]);
+        return 1;
+    }
+
+    w->keys[slot] = symbol;
+    w->values[slot] = w->count++;
+
+    size_t length = strlen(symbol);
+    putc(FASL_SYMBOL, w->out);
+    write_varint(w->out, length);
+    fwrite(symbol, 1, length, w->out);
+    return 1;
+}
+
+static int write_form(FaslWriter* w, Capsule cap) {
+    switch (cap.type) {
+    case CAPSULE_TYPE_NIL:
+        putc(FASL_NIL, w->out);
+        return 1;
+    case CAPSULE_TYPE_INTEGER:
+        putc(FASL_INTEGER, w->out);
+        write_varint(w->out, ((uint64_t)cap.as.integer << 1) ^ (uint64_t)(cap.as.integer >> 63));
+        return 1;
+    case CAPSULE_TYPE_DECIMAL:
+        putc(FASL_DECIMAL, w->out);
+        fwrite(&cap.as.decimal, sizeof(double), 1, w->out);
+        return 1;
+    case CAPSULE_TYPE_STRING: {
+        size_t length = strlen(cap.as.symbol);
+        putc(FASL_STRING, w->out);
+        write_varint(w->out, length);
+        fwrite(cap.as.symbol, 1, length, w->out);
+        return 1;
+    }
+    case CAPSULE_TYPE_SYMBOL:
+        return write_symbol(w, cap.as.symbol);
+    case CAPSULE_TYPE_PAIR: {
+        uint64_t count = 0;
+        Capsule iter = cap;
+        for (; iter.type == CAPSULE_TYPE_PAIR; iter = CAPSULE_CDR(iter))
+            count++;
+
+        putc(FASL_LIST, w->out);
+        write_varint(w->out, count);
+        for (iter = cap; iter.type == CAPSULE_TYPE_PAIR; iter = CAPSULE_CDR(iter))
+            if (!write_form(w, CAPSULE_CAR(iter)))
+                return 0;
+        return write_form(w, iter);
+    }
+    default:
+        /* the reader never produces anything else */
+        return 0;
+    }
+}
+
+static int read_varint(FaslReader* r, uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64 && r->position < r->end; shift += 7) {
+        unsigned char byte = *r->position++;
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return 1;
+    }
+    return 0;
+}
+
+static CapsuleError read_form(FaslReader* r, Capsule* result) {
+    uint64_t value;
+    int tag;
+
+    if (r->position == r->end)
+        return CAPSULE_ERROR_SYNTAX;
+
+    switch (tag = *r->position++) {
+    case FASL_NIL:
+        *result = Capsule_nil;
+        return CAPSULE_ERROR_NONE;
+    case FASL_INTEGER:
+        if (!read_varint(r, &value))
+            return CAPSULE_ERROR_SYNTAX;
+        *result = CAPSULE_INTEGER((long)(value >> 1) ^ -(long)(value & 1));
+        return CAPSULE_ERROR_NONE;
+    case FASL_DECIMAL: {
+        double decimal;
+        if ((size_t)(r->end - r->position) < sizeof(double))
+            return CAPSULE_ERROR_SYNTAX;
+        memcpy(&decimal, r->position, sizeof(double));
+        r->position += sizeof(double);
+        *result = CAPSULE_DECIMAL(decimal);
+        return CAPSULE_ERROR_NONE;
+    }
+    case FASL_STRING:
+    case FASL_SYMBOL: {
+        if (!read_varint(r, &value) || value > (uint64_t)(r->end - r->position))
+            return CAPSULE_ERROR_SYNTAX;
+
+        if (tag == FASL_STRING) {
+            memcpy(string_alloc(value, result), r->position, value);
+            r->position += value;
+            return CAPSULE_ERROR_NONE;
+        }
+
+        if (r->count == r->capacity) {
+            r->capacity = r->capacity ? r->capacity * 2 : 256;
+            r->symbols = realloc(r->symbols, r->capacity * sizeof(Capsule));
+            if (r->symbols == NULL)
+                return CAPSULE_ERROR_RUNTIME;
+        }
+        *result = r->symbols[r->count++] = symbol_intern_n((const char*)r->position, value, 0);
+        r->position += value;
+        return CAPSULE_ERROR_NONE;
+    }
+    case FASL_SYMBOL_REF:
+        if (!read_varint(r, &value) || value >= r->count)
+            return CAPSULE_ERROR_SYNTAX;
+        *result = r->symbols[value];
+        return CAPSULE_ERROR_NONE;
+    case FASL_LIST: {
+        Capsule last = Capsule_nil, item;
+        CapsuleError error;
+
+        if (!read_varint(r, &value))
+            return CAPSULE_ERROR_SYNTAX;
+
+        /* nothing collects while a form is read, the partial list needs no rooting */
+        *result = Capsule_nil;
+        for (; value > 0; value--) {
+            if ((error = read_form(r, &item)))
+                return error;
+            Capsule pair = Capsule_cons(item, Capsule_nil);
+            if (CAPSULE_NILP(last))
+                *result = pair;
+            else
+                CAPSULE_CDR(last) = pair;
+            last = pair;
+        }
+
+        if ((error = read_form(r, &item)))
+            return error;
+        if (CAPSULE_NILP(last))
+            *result = item;
+        else
+            CAPSULE_CDR(last) = item;
+        return CAPSULE_ERROR_NONE;
+    }
+    default:
+        return CAPSULE_ERROR_SYNTAX;
+    }
+}
+
+static CapsuleError fasl_next(void* source, Capsule* result) {
+    FaslReader* r = source;
+    if (r->position == r->end)
+        return CAPSULE_ERROR_EOF;
+    return read_form(r, result);
+}
+
+/* a source read for the first time, its forms go to the cache on their way to evaluation */
+typedef struct {
+    CapsuleReader reader;
+    FaslWriter writer;
+    int ok;
+} CacheSource;
+
+static CapsuleError cache_next(void* source, Capsule* result) {
+    CacheSource* c = source;
+    CapsuleError error = Capsule_Reader_next(&c->reader, result);
+
+    if (!error && c->ok)
+        c->ok = write_form(&c->writer, *result);
+    return error;
+}
+
+static char* cache_path(const char* path) {
+    size_t length = strlen(path);
+    char* cache = malloc(length + sizeof(FASL_EXTENSION));
+    if (cache == NULL)
+        return NULL;
+
+    /* script.cap caches to script.capc, anything else gets the extension appended */
+    memcpy(cache, path, length + 1);
+    if (length >= 4 && strcmp(path + length - 4, ".cap") == 0)
+        length -= 4;
+    strcpy(cache + length, FASL_EXTENSION);
+    return cache;
+}
+
+/* evaluates the forms of CACHE if it was written for the source HEADER describes, returns whether it was */
+static int cache_eval(const char* cache, const FaslHeader* header, Capsule scope, Capsule* result, CapsuleError* error) {
+    size_t size, length;
+    char* data = map_file(cache, 0, &size, &length);
+
+    if (data == NULL)
+        return 0;
+    if (size < sizeof(*header) || memcmp(data, header, sizeof(*header)) != 0) {
+        unmap_file(data, length);
+        return 0;
+    }
+
+    FaslReader reader = {.position = (unsigned char*)data + sizeof(*header), .end = (unsigned char*)data + size};
+    *error = eval_forms(fasl_next, &reader, scope, result);
+    free(reader.symbols);
+    unmap_file(data, length);
+    return 1;
+}
+
+/* an unnamed file in the directory of CACHE, -1 when it can not be written there */
+static int cache_open(const char* cache) {
+#ifdef O_TMPFILE
+    char* dir = strdup(cache);
+    char* slash;
+    int fd;
+
+    if (dir == NULL)
+        return -1;
+    if ((slash = strrchr(dir, '/')) == dir)
+        slash[1] = '\0';
+    else if (slash != NULL)
+        *slash = '\0';
+    fd = open(slash != NULL ? dir : ".", O_TMPFILE | O_WRONLY, 0644);
+    free(dir);
+    return fd;
+#else
+    (void)cache;
+    return -1;
+#endif
+}
+
+/* names the file open on FD as CACHE, replacing the stale one */
+static void cache_link(int fd, const char* cache) {
+    char proc[64];
+
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    unlink(cache);
+    linkat(AT_FDCWD, proc, AT_FDCWD, cache, AT_SYMLINK_FOLLOW);
+}
+
+CapsuleError fasl_eval(const char* path, const char* source, size_t size, Capsule scope, Capsule* result) {
+    FaslHeader header = {0};
+    CacheSource c = {.ok = 0};
+    CapsuleError error;
+    struct stat st;
+    char* cache = NULL;
+    int fd = -1;
+
+    if (stat(path, &st) == 0 && (cache = cache_path(path)) != NULL) {
+        memcpy(header.magic, FASL_MAGIC, sizeof(header.magic));
+        header.version = FASL_VERSION;
+        header.mtime_sec = st.st_mtim.tv_sec;
+        header.mtime_nsec = st.st_mtim.tv_nsec;
+        header.size = size;
+        header.hash = source_hash(source, size);
+
+        if (cache_eval(cache, &header, scope, result, &error)) {
+            free(cache);
+            return error;
+        }
+        /* a directory we can not write to only means no cache */
+        if ((fd = cache_open(cache)) >= 0 && (c.writer.out = fdopen(fd, "wb")) != NULL)
+            c.ok = fwrite(&header, sizeof(header), 1, c.writer.out) == 1;
+        else if (fd >= 0)
+            close(fd);
+    }
+
+    /* the source is evaluated as it is read and reports where it stops reading */
+    Capsule_Reader_init_buffer(&c.reader, source);
+    error = eval_forms(cache_next, &c, scope, result);
+
+    if (c.writer.out != NULL) {
+        c.ok = c.ok && !error && fflush(c.writer.out) == 0 && !ferror(c.writer.out);
+        if (c.ok)
+            cache_link(fileno(c.writer.out), cache);
+        fclose(c.writer.out);
+    }
+    free(c.writer.keys);
+    free(c.writer.values);
+    free(cache);
+    return error;
+}
@@ -0,0 +1,391 @@
+/*
+ * Copyright (c) 2024 Manjeet Singh <itsmanjeet1998@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Heap images
+ *
+ * An image is a header followed by records laid out exactly like live
+ * allocations, an Allocation header and its payload padded to 8 bytes.
+ * References between records are stored as record indices. Builtins and raw
+ * pointers are stored as the index of a string record holding their name and
+ * are resolved again on load. Loading maps the file privately, relocates the
+ * references in place and leaves every record frozen.
+ */
+
+#include "priv.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define IMAGE_MAGIC "CAPSULE"
+#define IMAGE_VERSION 1
+
+#define IMAGE_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t count;
+    uint64_t size;
+    Capsule root;
+} ImageHeader;
+
+static const struct {
+    const char* name;
+    FILE** file;
+} IMAGE_POINTERS[] = {
+    {"STDOUT", &stdout},
+    {"STDERR", &stderr},
+    {"STDIN", &stdin},
+};
+
+#define IMAGE_POINTERS_COUNT (sizeof(IMAGE_POINTERS) / sizeof(IMAGE_POINTERS[0]))
+
+typedef struct {
+    const void** keys;
+    uint64_t* values;
+    size_t capacity;
+    size_t count;
+
+    Capsule* objects;
+    size_t objects_capacity;
+    uint64_t size;
+} ImageWriter;
+
+static int heap_typep(CapsuleType type) {
+    switch (type) {
+    case CAPSULE_TYPE_PAIR:
+    case CAPSULE_TYPE_CLOSURE:
+    case CAPSULE_TYPE_MACRO:
+    case CAPSULE_TYPE_STRING:
+    case CAPSULE_TYPE_SYMBOL:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static size_t payload_size(Capsule cap) {
+    if (cap.type == CAPSULE_TYPE_STRING || cap.type == CAPSULE_TYPE_SYMBOL)
+        return IMAGE_ALIGN(strlen(cap.as.symbol) + 1);
+    return sizeof(struct CapsulePair);
+}
+
+static size_t writer_slot(ImageWriter* w, const void* key) {
+    size_t i = ((uintptr_t)key >> 3) * 11400714819323198485ull & (w->capacity - 1);
+    while (w->keys[i] != NULL && w->keys[i] != key)
+        i = (i + 1) & (w->capacity - 1);
+    return i;
+}
+
+static int writer_grow(ImageWriter* w) {
+    ImageWriter old = *w;
+
+    w->capacity = old.capacity ? old.capacity * 2 : 1024;
+    w->keys = calloc(w->capacity, sizeof(*w->keys));
+    w->values = malloc(w->capacity * sizeof(*w->values));
+    if (w->keys == NULL || w->values == NULL)
+        return 0;
+
+    for (size_t i = 0; i < old.capacity; i++) {
+        if (old.keys[i] != NULL) {
+            size_t slot = writer_slot(w, old.keys[i]);
+            w->keys[slot] = old.keys[i];
+            w->values[slot] = old.values[i];
+        }
+    }
+    free(old.keys);
+    free(old.values);
+    return 1;
+}
+
+/* returns the record index of cap, registering it on first sight */
+static int64_t writer_index(ImageWriter* w, Capsule cap, int* fresh) {
+    const void* key = cap.as.pointer;
+    size_t slot;
+
+    *fresh = 0;
+    if ((w->count + 1) * 2 > w->capacity && !writer_grow(w))
+        return -1;
+
+    slot = writer_slot(w, key);
+    if (w->keys[slot] != NULL)
+        return (int64_t)w->values[slot];
+
+    if (w->count == w->objects_capacity) {
+        w->objects_capacity = w->objects_capacity ? w->objects_capacity * 2 : 1024;
+        w->objects = realloc(w->objects, w->objects_capacity * sizeof(Capsule));
+        if (w->objects == NULL)
+            return -1;
+    }
+
+    w->keys[slot] = key;
+    w->values[slot] = w->count;
+    w->objects[w->count] = cap;
+    w->size += sizeof(Allocation) + payload_size(cap);
+    *fresh = 1;
+    return (int64_t)w->count++;
+}
+
+/* builtins and raw pointers are referenced by a string record of their name */
+static int64_t writer_name(ImageWriter* w, const char* name) {
+    Capsule key = {.type = CAPSULE_TYPE_STRING, .as.symbol = name};
+    int fresh;
+    return writer_index(w, key, &fresh);
+}
+
+static const char* pointer_name(void* pointer) {
+    for (size_t i = 0; i < IMAGE_POINTERS_COUNT; i++) {
+        if (*IMAGE_POINTERS[i].file == pointer)
+            return IMAGE_POINTERS[i].name;
+    }
+    return NULL;
+}
+
+static CapsuleError encode(ImageWriter* w, Capsule cap, Capsule* encoded) {
+    int fresh;
+
+    encoded->type = cap.type;
+    encoded->as = cap.as;
+    if (heap_typep(cap.type)) {
+        encoded->as.integer = writer_index(w, cap, &fresh);
+    } else if (cap.type == CAPSULE_TYPE_BUILTIN) {
+        const char* name = builtin_name(cap.as.builtin);
+        if (name == NULL)
+            return CAPSULE_ERROR_RUNTIME;
+        encoded->as.integer = writer_name(w, name);
+    } else if (cap.type == CAPSULE_TYPE_POINTER) {
+        /* only NULL and the standard streams mean the same thing in the process loading the image */
+        const char* name = pointer_name(cap.as.pointer);
+        if (name == NULL && cap.as.pointer != NULL)
+            return CAPSULE_ERROR_RUNTIME;
+        encoded->as.integer = name ? writer_name(w, name) : -1;
+        return CAPSULE_ERROR_NONE;
+    } else {
+        return CAPSULE_ERROR_NONE;
+    }
+    return encoded->as.integer == -1 ? CAPSULE_ERROR_RUNTIME : CAPSULE_ERROR_NONE;
+}
+
+CapsuleError image_write(FILE* out, Capsule root) {
+    ImageWriter w = {0};
+    ImageHeader header;
+    CapsuleError error;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    header.version = IMAGE_VERSION;
+    header.header_size = sizeof(Allocation);
+
+    /* records are discovered in index order, so the object list is the work list */
+    if ((error = encode(&w, root, &header.root)))
+        goto exit_free;
+
+    for (size_t i = 0; i < w.count; i++) {
+        Capsule cap = w.objects[i];
+        if (cap.type == CAPSULE_TYPE_STRING || cap.type == CAPSULE_TYPE_SYMBOL)
+            continue;
+        Capsule car, cdr;
+        if ((error = encode(&w, CAPSULE_CAR(cap), &car)) || (error = encode(&w, CAPSULE_CDR(cap), &cdr)))
+            goto exit_free;
+    }
+
+    header.count = w.count;
+    header.size = w.size;
+    if (fwrite(&header, sizeof(header), 1, out) != 1) {
+        error = CAPSULE_ERROR_RUNTIME;
+        goto exit_free;
+    }
+
+    for (size_t i = 0; i < w.count; i++) {
+        Capsule cap = w.objects[i];
+        Allocation alloc;
+        struct CapsulePair pair;
+
+        memset(&alloc, 0, sizeof(alloc));
+        memset(&pair, 0, sizeof(pair));
+        alloc.mark = GC_FROZEN;
+        alloc.type = cap.type;
+        fwrite(&alloc, sizeof(alloc), 1, out);
+        if (cap.type == CAPSULE_TYPE_STRING || cap.type == CAPSULE_TYPE_SYMBOL) {
+            size_t length = strlen(cap.as.symbol);
+            fwrite(cap.as.symbol, 1, length, out);
+            fwrite(&pair, 1, payload_size(cap) - length, out);
+        } else {
+            encode(&w, CAPSULE_CAR(cap), &pair.pellete[0]);
+            encode(&w, CAPSULE_CDR(cap), &pair.pellete[1]);
+            fwrite(&pair, sizeof(pair), 1, out);
+        }
+    }
+
+    error = ferror(out) ? CAPSULE_ERROR_RUNTIME : CAPSULE_ERROR_NONE;
+
+exit_free:
+    free(w.keys);
+    free(w.values);
+    free(w.objects);
+    return error;
+}
+
+static CapsuleError decode(Capsule* cap, void** records, uint64_t count) {
+    if (heap_typep(cap->type)) {
+        if ((uint64_t)cap->as.integer >= count)
+            return CAPSULE_ERROR_SYNTAX;
+        cap->as.pointer = records[cap->as.integer];
+    } else if (cap->type == CAPSULE_TYPE_BUILTIN) {
+        if ((uint64_t)cap->as.integer >= count)
+            return CAPSULE_ERROR_SYNTAX;
+        cap->as.builtin = builtin_lookup(records[cap->as.integer]);
+        if (cap->as.builtin == NULL)
+            return CAPSULE_ERROR_UNBOUND;
+    } else if (cap->type == CAPSULE_TYPE_POINTER) {
+        const char* name = cap->as.integer >= 0 && (uint64_t)cap->as.integer < count ? records[cap->as.integer] : NULL;
+        cap->as.pointer = NULL;
+        for (size_t i = 0; name && i < IMAGE_POINTERS_COUNT; i++) {
+            if (strcmp(IMAGE_POINTERS[i].name, name) == 0)
+                cap->as.pointer = *IMAGE_POINTERS[i].file;
+        }
+    }
+    return CAPSULE_ERROR_NONE;
+}
+
+CapsuleError image_load(void* image, size_t size, Capsule* root) {
+    ImageHeader* header = image;
+    CapsuleError error = CAPSULE_ERROR_NONE;
+    char *p, *end;
+    void** records;
+
+    if (size < sizeof(*header) || memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != IMAGE_VERSION || header->header_size != sizeof(Allocation) ||
+        header->size > size - sizeof(*header))
+        return CAPSULE_ERROR_SYNTAX;
+
+    records = malloc(sizeof(void*) * (header->count ? header->count : 1));
+    if (records == NULL)
+        return CAPSULE_ERROR_RUNTIME;
+
+    p = (char*)(header + 1);
+    end = p + header->size;
+    /* every record is checked to lie inside the image before any of it is read */
+    for (uint64_t i = 0; i < header->count; i++) {
+        Allocation* alloc = (Allocation*)p;
+        size_t payload;
+
+        if ((size_t)(end - p) < sizeof(Allocation) || !heap_typep(alloc->type)) {
+            error = CAPSULE_ERROR_SYNTAX;
+            goto exit_free;
+        }
+        p += sizeof(Allocation);
+
+        if (alloc->type == CAPSULE_TYPE_STRING || alloc->type == CAPSULE_TYPE_SYMBOL) {
+            size_t length = strnlen(p, end - p);
+            payload = length == (size_t)(end - p) ? SIZE_MAX : IMAGE_ALIGN(length + 1);
+        } else {
+            payload = sizeof(struct CapsulePair);
+        }
+        if (payload > (size_t)(end - p)) {
+            error = CAPSULE_ERROR_SYNTAX;
+            goto exit_free;
+        }
+
+        Capsule cap = {.type = alloc->type, .as.pointer = alloc + 1};
+        alloc->mark = GC_FROZEN;
+        alloc->next = NULL;
+        alloc->deallocate = NULL;
+        alloc->pointer = alloc + 1;
+        if (cap.type == CAPSULE_TYPE_SYMBOL)
+            cap = symbol_intern(cap);
+
+        records[i] = cap.as.pointer;
+        p += payload;
+    }
+    if (p != end) {
+        error = CAPSULE_ERROR_SYNTAX;
+        goto exit_free;
+    }
+
+    p = (char*)(header + 1);
+    for (uint64_t i = 0; i < header->count; i++) {
+        Allocation* alloc = (Allocation*)p;
+        p += sizeof(Allocation);
+        if (alloc->type == CAPSULE_TYPE_STRING || alloc->type == CAPSULE_TYPE_SYMBOL) {
+            p += IMAGE_ALIGN(strlen(p) + 1);
+            continue;
+        }
+
+        struct CapsulePair* pair = (struct CapsulePair*)p;
+        if ((error = decode(&pair->pellete[0], records, header->count)) ||
+            (error = decode(&pair->pellete[1], records, header->count)))
+            goto exit_free;
+        p += sizeof(struct CapsulePair);
+    }
+
+    *root = header->root;
+    error = decode(root, records, header->count);
+
+exit_free:
+    free(records);
+    return error;
+}
+
+CapsuleError Capsule_Image_dump(const char* path, Capsule scope) {
+    CapsuleError error;
+    FILE* out = fopen(path, "wb");
+    if (out == NULL)
+        return CAPSULE_ERROR_RUNTIME;
+
+    error = image_write(out, scope);
+    if (fclose(out) != 0 && !error)
+        error = CAPSULE_ERROR_RUNTIME;
+    return error;
+}
+
+CapsuleError Capsule_Image_load(const char* path, Capsule* scope) {
+    CapsuleError error;
+    struct stat st;
+    void* image;
+    Capsule root;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return CAPSULE_ERROR_RUNTIME;
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return CAPSULE_ERROR_RUNTIME;
+    }
+
+    /* private mapping, relocated pages are copied and the rest stay shared */
+    image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return CAPSULE_ERROR_RUNTIME;
+
+    if ((error = image_load(image, st.st_size, &root))) {
+        munmap(image, st.st_size);
+        return error;
+    }
+
+    scope_global_init(root);
+    *scope = Capsule_Scope_global();
+    return CAPSULE_ERROR_NONE;
+}
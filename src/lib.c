@@ -17,8 +17,12 @@
 
 #include "logo.h"
 #include "priv.h"
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 char* slurp(const char* path) {
     char* buffer = NULL;
@@ -45,6 +49,53 @@ exit_return:
     return buffer;
 }
 
+/*
+ * Maps a regular file privately, `offset` bytes of zeroed writable memory
+ * (a multiple of the page size) precede the content and at least one NUL
+ * byte follows it. Returns the start of the whole region or NULL.
+ */
+char* map_file(const char* path, size_t offset, size_t* size, size_t* length) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    struct stat st;
+    char* base = NULL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        goto exit_close;
+
+    *size = st.st_size;
+    *length = offset + ((*size + page) & ~(page - 1));
+
+    /* reserve zeroed pages first so the bytes past the file content read as NUL */
+    base = mmap(NULL, *length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        base = NULL;
+        goto exit_close;
+    }
+
+    if (*size && mmap(base + offset, *size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, *length);
+        base = NULL;
+    }
+
+exit_close:
+    close(fd);
+    return base;
+}
+
+void unmap_file(char* base, size_t length) {
+    munmap(base, length);
+}
+
+uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 const char* Capsule_logo() {
     return LOGO;
 }
\ No newline at end of file
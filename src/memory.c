@@ -17,21 +17,36 @@
 
 #include "priv.h"
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-
-typedef struct Allocation {
-    int mark;
-    CapsuleType type;
-    struct Allocation* next;
-    void (*deallocate)(void*);
-    void* pointer;
-} Allocation;
+#include <unistd.h>
 
 static Allocation* global_allocations = NULL;
 
-Allocation* Capsule_alloc(CapsuleType type, size_t size, void (*deallocate)(void*)) {
-    Allocation* alloc = malloc(sizeof(Allocation) + size);
+/* allocations promoted by gc_freeze(), never marked or swept again */
+static Allocation* frozen_allocations = NULL;
+
+/* frozen pairs that were mutated after freezing, their fields are roots */
+static Capsule remembered = {CAPSULE_TYPE_NIL};
+
+#define GC_MAX_PROTECTED 32
+
+static Capsule* protected[GC_MAX_PROTECTED];
+static int protected_count = 0;
+
+#ifdef STRESS_GC
+#    define GC_ALLOCATION_THRESHOLD 1
+#else
+#    define GC_ALLOCATION_THRESHOLD 100000
+#endif
+
+static size_t allocations_since_gc = 0;
+
+RuntimeStats runtime_stats;
+
+static void gc_track(Allocation* alloc, CapsuleType type, void (*deallocate)(void*)) {
+    allocations_since_gc++;
     alloc->mark = 0;
     alloc->type = type;
     alloc->next = global_allocations;
@@ -39,6 +54,15 @@ Allocation* Capsule_alloc(CapsuleType type, size_t size, void (*deallocate)(void
     global_allocations = alloc;
 
     alloc->pointer = alloc + 1;
+}
+
+Allocation* Capsule_alloc(CapsuleType type, size_t size, void (*deallocate)(void*)) {
+    Allocation* alloc = malloc(sizeof(Allocation) + size);
+    runtime_stats.allocated += sizeof(Allocation) + size;
+#ifdef PROFILE_ALLOC
+    profile_allocation(type, size);
+#endif
+    gc_track(alloc, type, deallocate);
     return alloc;
 }
 
@@ -52,90 +76,340 @@ Capsule Capsule_cons(Capsule car_val, Capsule cdr_val) {
     return pair;
 }
 
-Capsule Capsule_managed_pointer(void* pointer, void (*dellocate)(void*)) {
-    Allocation* alloc = Capsule_alloc(CAPSULE_TYPE_POINTER, sizeof(void*), dellocate);
-    Capsule cap = {.type = CAPSULE_TYPE_POINTER, .as.pointer = alloc->pointer = pointer};
+/*
+ * Managed pointers, the value only carries the foreign pointer so the owning
+ * allocation is found through a table keyed by it. The payload holds the
+ * user deallocator with its argument, and a value kept alive as long as the
+ * pointer is.
+ */
+typedef struct {
+    void (*deallocate)(void*);
+    void* context;
+    Capsule data;
+} Managed;
+
+static Allocation** managed = NULL;
+static size_t managed_capacity = 0;
+static size_t managed_count = 0;
+
+static size_t managed_home(void* pointer, size_t capacity) {
+    return ((uintptr_t)pointer >> 4) * 11400714819323198485ull & (capacity - 1);
+}
+
+static size_t managed_slot(Allocation** table, size_t capacity, void* pointer) {
+    size_t slot = managed_home(pointer, capacity);
+    while (table[slot] != NULL && table[slot]->pointer != pointer)
+        slot = (slot + 1) & (capacity - 1);
+    return slot;
+}
+
+static Allocation* managed_lookup(void* pointer) {
+    if (managed_count == 0)
+        return NULL;
+    return managed[managed_slot(managed, managed_capacity, pointer)];
+}
+
+static void managed_insert(Allocation* alloc) {
+    if ((managed_count + 1) * 2 > managed_capacity) {
+        size_t capacity = managed_capacity ? managed_capacity * 2 : 16;
+        Allocation** table = calloc(capacity, sizeof(Allocation*));
+        for (size_t i = 0; i < managed_capacity; i++)
+            if (managed[i] != NULL)
+                table[managed_slot(table, capacity, managed[i]->pointer)] = managed[i];
+        free(managed);
+        managed = table;
+        managed_capacity = capacity;
+    }
+    managed[managed_slot(managed, managed_capacity, alloc->pointer)] = alloc;
+    managed_count++;
+}
+
+/* backward shift deletion keeps probe chains intact without tombstones */
+static void managed_remove(void* pointer) {
+    size_t hole = managed_slot(managed, managed_capacity, pointer), mask = managed_capacity - 1;
+
+    managed[hole] = NULL;
+    managed_count--;
+    for (size_t slot = (hole + 1) & mask; managed[slot] != NULL; slot = (slot + 1) & mask) {
+        size_t home = managed_home(managed[slot]->pointer, managed_capacity);
+        if (((slot - home) & mask) < ((slot - hole) & mask))
+            continue;
+        managed[hole] = managed[slot];
+        managed[slot] = NULL;
+        hole = slot;
+    }
+}
+
+static void managed_release(void* alloc) {
+    Allocation* a = alloc;
+    Managed* m = (Managed*)(a + 1);
+
+    managed_remove(a->pointer);
+    if (m->deallocate)
+        m->deallocate(m->context);
+    free(a);
+}
+
+/* whether CAP is a pointer owned by the collector and released with DEALLOCATE */
+int managed_pointerp(Capsule cap, void (*deallocate)(void*)) {
+    Allocation* alloc = CAPSULE_POINTERP(cap) ? managed_lookup(cap.as.pointer) : NULL;
+    return alloc != NULL && ((Managed*)(alloc + 1))->deallocate == deallocate;
+}
+
+/* POINTER owned by the collector, DEALLOCATE gets CONTEXT once neither it nor DATA is reachable */
+Capsule managed_pointer_new(void* pointer, void (*deallocate)(void*), void* context, Capsule data) {
+    Capsule cap = {.type = CAPSULE_TYPE_POINTER, .as.pointer = pointer};
+    Allocation* alloc = managed_lookup(pointer);
+
+    /* a pointer has a single owner, wrapping it again is the same value and deallocates nothing */
+    if (alloc != NULL)
+        return cap;
+
+    alloc = Capsule_alloc(CAPSULE_TYPE_POINTER, sizeof(Managed), managed_release);
+    *(Managed*)(alloc + 1) = (Managed){.deallocate = deallocate, .context = context, .data = data};
+    alloc->pointer = pointer;
+    managed_insert(alloc);
     return cap;
 }
 
-Capsule Capsule_String_new(const char* str) {
-    size_t size = strlen(str);
+Capsule Capsule_managed_pointer(void* pointer, void (*dellocate)(void*)) {
+    return managed_pointer_new(pointer, dellocate, pointer, Capsule_nil);
+}
+
+char* string_alloc(size_t size, Capsule* result) {
     Allocation* alloc = Capsule_alloc(CAPSULE_TYPE_STRING, sizeof(char) * (size + 1), free);
+    char* buffer = alloc->pointer;
 
-    Capsule string = {
-        .type = CAPSULE_TYPE_STRING,
-        .as.symbol = alloc->pointer,
-    };
+    buffer[size] = '\0';
+    *result = (Capsule){.type = CAPSULE_TYPE_STRING, .as.symbol = buffer};
+    return buffer;
+}
 
-    memcpy(alloc->pointer, str, size);
-    char* buffer = alloc->pointer;
+/*
+ * A string of unknown length grows as an untracked block, string_grow moves
+ * it freely and string_finish hands it to the collector at its final size.
+ */
+Allocation* string_grow(Allocation* alloc, size_t capacity) {
+    return realloc(alloc, sizeof(Allocation) + sizeof(char) * (capacity + 1));
+}
+
+char* string_finish(Allocation* alloc, size_t size, Capsule* result) {
+    Allocation* fitted = string_grow(alloc, size);
+    char* buffer;
+
+    /* giving back the spare capacity may fail, the block is still good */
+    if (fitted != NULL)
+        alloc = fitted;
+    runtime_stats.allocated += sizeof(Allocation) + sizeof(char) * (size + 1);
+#ifdef PROFILE_ALLOC
+    profile_allocation(CAPSULE_TYPE_STRING, sizeof(char) * (size + 1));
+#endif
+    gc_track(alloc, CAPSULE_TYPE_STRING, free);
+
+    buffer = alloc->pointer;
     buffer[size] = '\0';
+    *result = (Capsule){.type = CAPSULE_TYPE_STRING, .as.symbol = buffer};
+    return buffer;
+}
+
+Capsule Capsule_String_new(const char* str) {
+    Capsule string;
+    size_t size = strlen(str);
+    memcpy(string_alloc(size, &string), str, size);
     return string;
 }
 
-static Capsule sym_table = {CAPSULE_TYPE_NIL};
+/*
+ * A file mapped as a string, the first page holds the mapping length and ends
+ * with the allocation header so the string is traced like any other.
+ */
+static void string_unmap(void* alloc) {
+    char* base = (char*)((Allocation*)alloc + 1) - sysconf(_SC_PAGESIZE);
+    unmap_file(base, *(size_t*)base);
+}
+
+CapsuleError string_map(const char* path, Capsule* result) {
+    size_t page = sysconf(_SC_PAGESIZE), size, length;
+    char* base = map_file(path, page, &size, &length);
+    if (base == NULL)
+        return CAPSULE_ERROR_RUNTIME;
 
-Capsule Capsule_Symbol_new(const char* s) {
-    Capsule a, p;
+    *(size_t*)base = length;
+    Allocation* alloc = (Allocation*)(base + page) - 1;
+    gc_track(alloc, CAPSULE_TYPE_STRING, string_unmap);
+
+    *result = (Capsule){.type = CAPSULE_TYPE_STRING, .as.symbol = alloc->pointer};
+    return CAPSULE_ERROR_NONE;
+}
 
-    p = sym_table;
-    while (!CAPSULE_NILP(p)) {
-        a = CAPSULE_CAR(p);
-        if (strcmp(a.as.symbol, s) == 0)
-            return a;
-        p = CAPSULE_CDR(p);
+/*
+ * Interned symbols, open addressing keyed by the symbol name. Symbols are
+ * never collected so they are allocated frozen and the collector never
+ * visits them.
+ */
+typedef struct {
+    size_t hash;
+    size_t length;
+    const char* name;
+} SymbolEntry;
+
+static SymbolEntry* symbols = NULL;
+static size_t symbols_capacity = 0;
+static size_t symbols_count = 0;
+
+#define SYMBOL_FOLD(c) ((c) >= 'a' && (c) <= 'z' ? (c) - ('a' - 'A') : (c))
+
+static size_t symbol_hash(const char* s, size_t n, int fold) {
+    size_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < n; i++) {
+        hash ^= (unsigned char)(fold ? SYMBOL_FOLD(s[i]) : s[i]);
+        hash *= 1099511628211ull;
     }
+    return hash;
+}
 
-    a = Capsule_String_new(s);
-    a.type = CAPSULE_TYPE_SYMBOL;
-    sym_table = CAPSULE_CONS(a, sym_table);
+static int symbol_equal(const SymbolEntry* entry, size_t hash, const char* s, size_t n, int fold) {
+    if (entry->hash != hash || entry->length != n)
+        return 0;
+    if (!fold)
+        return memcmp(entry->name, s, n) == 0;
+    for (size_t i = 0; i < n; i++) {
+        if (entry->name[i] != SYMBOL_FOLD(s[i]))
+            return 0;
+    }
+    return 1;
+}
 
-    return a;
+static void symbols_grow() {
+    SymbolEntry* old = symbols;
+    size_t old_capacity = symbols_capacity;
+
+    symbols_capacity = old_capacity ? old_capacity * 2 : 1024;
+    symbols = calloc(symbols_capacity, sizeof(SymbolEntry));
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].name == NULL)
+            continue;
+        size_t slot = old[i].hash & (symbols_capacity - 1);
+        while (symbols[slot].name != NULL)
+            slot = (slot + 1) & (symbols_capacity - 1);
+        symbols[slot] = old[i];
+    }
+    free(old);
 }
 
-void gc_mark(Capsule root) {
+/* finds the slot of a symbol, or the empty slot it belongs in */
+static SymbolEntry* symbol_slot(const char* s, size_t n, int fold, size_t* hash) {
+    size_t slot;
+
+    if ((symbols_count + 1) * 2 > symbols_capacity)
+        symbols_grow();
+
+    *hash = symbol_hash(s, n, fold);
+    slot = *hash & (symbols_capacity - 1);
+    while (symbols[slot].name != NULL && !symbol_equal(&symbols[slot], *hash, s, n, fold))
+        slot = (slot + 1) & (symbols_capacity - 1);
+    return &symbols[slot];
+}
+
+Capsule symbol_intern_n(const char* s, size_t n, int fold) {
+    size_t hash;
+    SymbolEntry* entry = symbol_slot(s, n, fold, &hash);
+
+    if (entry->name == NULL) {
+        Allocation* alloc = malloc(sizeof(Allocation) + n + 1);
+        char* name = (char*)(alloc + 1);
+
+        memset(alloc, 0, sizeof(*alloc));
+        alloc->mark = GC_FROZEN;
+        alloc->type = CAPSULE_TYPE_SYMBOL;
+        alloc->pointer = name;
+        for (size_t i = 0; i < n; i++)
+            name[i] = fold ? SYMBOL_FOLD(s[i]) : s[i];
+        name[n] = '\0';
+
+        *entry = (SymbolEntry){.hash = hash, .length = n, .name = name};
+        symbols_count++;
+    }
+
+    return (Capsule){.type = CAPSULE_TYPE_SYMBOL, .as.symbol = entry->name};
+}
 
-    Allocation* alloc;
+Capsule symbol_intern(Capsule symbol) {
+    size_t hash, n = strlen(symbol.as.symbol);
+    SymbolEntry* entry = symbol_slot(symbol.as.symbol, n, 0, &hash);
 
-    switch (root.type) {
+    if (entry->name == NULL) {
+        *entry = (SymbolEntry){.hash = hash, .length = n, .name = symbol.as.symbol};
+        symbols_count++;
+    }
+
+    return (Capsule){.type = CAPSULE_TYPE_SYMBOL, .as.symbol = entry->name};
+}
+
+Capsule Capsule_Symbol_new(const char* s) {
+    return symbol_intern_n(s, strlen(s), 0);
+}
+
+static Allocation* gc_header(Capsule cap) {
+    switch (cap.type) {
     case CAPSULE_TYPE_PAIR:
     case CAPSULE_TYPE_MACRO:
     case CAPSULE_TYPE_CLOSURE:
-        alloc = (Allocation*)(root.as.pair) - 1;
-        break;
+        return (Allocation*)(cap.as.pair) - 1;
     case CAPSULE_TYPE_STRING:
     case CAPSULE_TYPE_SYMBOL:
-        alloc = (Allocation*)(root.as.symbol) - 1;
-        break;
+        return (Allocation*)(cap.as.symbol) - 1;
     case CAPSULE_TYPE_POINTER:
-        alloc = (Allocation*)(root.as.pointer) - 1;
-        break;
+        return managed_lookup(cap.as.pointer);
     default:
-        return;
+        return NULL;
     }
+}
 
-    if (alloc->mark)
-        return;
+void gc_mark(Capsule root) {
+    for (;;) {
+        Allocation* alloc = gc_header(root);
+
+        if (alloc == NULL)
+            return;
+
+        if (alloc->mark)
+            return;
 
 #ifdef DEBUG_GC
-    fprintf(stdout, "marking");
-    Capsule_print(root, stdout);
-    fprintf(stdout, "\n");
+        fprintf(stdout, "marking");
+        Capsule_print(root, stdout);
+        fprintf(stdout, "\n");
 #endif
 
-    alloc->mark = 1;
-    switch (root.type) {
-    case CAPSULE_TYPE_PAIR:
-    case CAPSULE_TYPE_MACRO:
-    case CAPSULE_TYPE_CLOSURE:
-        gc_mark(CAPSULE_CAR(root));
-        gc_mark(CAPSULE_CDR(root));
-        break;
-    default:
-        break;
+        alloc->mark = 1;
+        switch (root.type) {
+        case CAPSULE_TYPE_PAIR:
+        case CAPSULE_TYPE_MACRO:
+        case CAPSULE_TYPE_CLOSURE:
+            /* recurse on CAR only, long lists are walked iteratively */
+            gc_mark(CAPSULE_CAR(root));
+            root = CAPSULE_CDR(root);
+            break;
+        case CAPSULE_TYPE_POINTER:
+            root = ((Managed*)(alloc + 1))->data;
+            break;
+        default:
+            return;
+        }
     }
 }
 
+void gc_protect(Capsule* root) {
+    if (protected_count < GC_MAX_PROTECTED)
+        protected[protected_count++] = root;
+}
+
+void gc_maybe() {
+    if (allocations_since_gc >= GC_ALLOCATION_THRESHOLD)
+        gc();
+}
+
 #ifdef DEBUG_GC
 static void print_allocations() {
     Allocation* a = global_allocations;
@@ -176,10 +450,69 @@ static void print_allocations() {
 }
 #endif
 
+int gc_frozenp(Capsule cap) {
+    Allocation* alloc = gc_header(cap);
+    return alloc != NULL && alloc->mark <= GC_FROZEN;
+}
+
+/* whether a collection could free CAP, immediates and frozen values like interned symbols never are */
+int gc_collectablep(Capsule cap) {
+    Allocation* alloc = gc_header(cap);
+    return alloc != NULL && alloc->mark > GC_FROZEN;
+}
+
+void gc_write_barrier(Capsule cap) {
+    Allocation* alloc = gc_header(cap);
+    if (alloc == NULL || alloc->mark != GC_FROZEN)
+        return;
+
+    alloc->mark = GC_REMEMBERED;
+    remembered = CAPSULE_CONS(cap, remembered);
+}
+
+void gc_freeze(Capsule root) {
+    Allocation *a = NULL, **p = NULL;
+
+    gc_mark(root);
+
+    p = &global_allocations;
+    while ((a = *p) != NULL) {
+        if (a->mark) {
+            *p = a->next;
+            a->mark = GC_FROZEN;
+            a->next = frozen_allocations;
+            frozen_allocations = a;
+        } else {
+            p = &a->next;
+        }
+    }
+}
+
 void gc() {
     Allocation *a = NULL, *prev = NULL, **p = NULL;
+    uint64_t start = clock_ns(CLOCK_MONOTONIC);
+
+    allocations_since_gc = 0;
+
+    for (EvalState* state = eval_state; state != NULL; state = state->parent) {
+        gc_mark(*state->expr);
+        gc_mark(*state->scope);
+        gc_mark(*state->stack);
+        gc_mark(*state->result);
+        gc_mark(state->escapes);
+        for (size_t i = 0; i < state->count; i++)
+            gc_mark(state->values[i]);
+    }
+    for (int i = 0; i < protected_count; i++) {
+        gc_mark(*protected[i]);
+    }
+    sched_mark();
 
-    gc_mark(sym_table);
+    for (Capsule r = remembered; !CAPSULE_NILP(r); r = CAPSULE_CDR(r)) {
+        gc_mark(CAPSULE_CAR(CAPSULE_CAR(r)));
+        gc_mark(CAPSULE_CDR(CAPSULE_CAR(r)));
+    }
+    gc_mark(remembered);
 #ifdef DEBUG_GC
     // print_allocations();
 #endif
@@ -227,4 +560,7 @@ void gc() {
         a->mark = 0;
         a = a->next;
     }
+
+    runtime_stats.collections++;
+    runtime_stats.gc_ns += clock_ns(CLOCK_MONOTONIC) - start;
 }
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2024 Manjeet Singh <itsmanjeet1998@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Native modules
+ *
+ * A module <id> is the lib<id>.so built by add_module, searched in the
+ * directories of CAPSULE_MODULE_PATH and then in CAPSULE_MODULE_DIR. It is
+ * opened once and its Capsule_<id>_init defines its builtins into a scope
+ * of its own, the scope is cached by name so requiring it again is a lookup.
+ * Modules stay loaded for the life of the process, their builtins may be
+ * referenced from anywhere.
+ */
+
+#include "priv.h"
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef CAPSULE_MODULE_DIR
+#    define CAPSULE_MODULE_DIR "/usr/lib/capsule"
+#endif
+
+/* (name . scope) of every loaded module */
+static Capsule modules = {CAPSULE_TYPE_NIL};
+static int modules_rooted = 0;
+
+static int module_find(const char* id, char* path, size_t size) {
+    const char* dirs = getenv("CAPSULE_MODULE_PATH");
+    const char* end;
+
+    if (strchr(id, '/') != NULL) {
+        snprintf(path, size, "%s", id);
+        return access(path, R_OK) == 0;
+    }
+
+    for (; dirs != NULL && *dirs != '\0'; dirs = *end ? end + 1 : end) {
+        end = strchr(dirs, ':');
+        if (end == NULL)
+            end = dirs + strlen(dirs);
+        if (end == dirs)
+            continue;
+        snprintf(path, size, "%.*s/lib%s.so", (int)(end - dirs), dirs, id);
+        if (access(path, R_OK) == 0)
+            return 1;
+    }
+
+    snprintf(path, size, "%s/lib%s.so", CAPSULE_MODULE_DIR, id);
+    return access(path, R_OK) == 0;
+}
+
+CapsuleError module_require(const char* id, Capsule* result) {
+    char path[4096], entry[256];
+    const char* base = strrchr(id, '/') ? strrchr(id, '/') + 1 : id;
+    size_t n = 0;
+
+    for (Capsule m = modules; !CAPSULE_NILP(m); m = CAPSULE_CDR(m)) {
+        if (strcmp(CAPSULE_AS_STRING(CAPSULE_CAR(CAPSULE_CAR(m))), id) == 0) {
+            *result = CAPSULE_CDR(CAPSULE_CAR(m));
+            return CAPSULE_ERROR_NONE;
+        }
+    }
+
+    if (!module_find(id, path, sizeof(path))) {
+        fprintf(stderr, "Module %s not found\n", id);
+        return CAPSULE_ERROR_RUNTIME;
+    }
+
+    /* a path names its library, the entry point comes from the file name */
+    if (strncmp(base, "lib", 3) == 0 && base != id)
+        base += 3;
+    n = snprintf(entry, sizeof(entry), "Capsule_");
+    for (; *base != '\0' && *base != '.' && n < sizeof(entry) - sizeof("_init"); base++)
+        entry[n++] = (*base == '-') ? '_' : *base;
+    snprintf(entry + n, sizeof(entry) - n, "_init");
+
+    void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+        fprintf(stderr, "%s\n", dlerror());
+        return CAPSULE_ERROR_RUNTIME;
+    }
+
+    CapsuleModuleInit init = (CapsuleModuleInit)dlsym(handle, entry);
+    if (init == NULL) {
+        fprintf(stderr, "%s\n", dlerror());
+        dlclose(handle);
+        return CAPSULE_ERROR_RUNTIME;
+    }
+
+    Capsule scope = Capsule_Scope_new(Capsule_nil);
+    CapsuleError error;
+    if (!modules_rooted++)
+        gc_protect(&modules);
+    /* registered first so the scope stays rooted while the module fills it */
+    modules = CAPSULE_CONS(CAPSULE_CONS(CAPSULE_STRING(id), scope), modules);
+    if ((error = init(scope))) {
+        modules = CAPSULE_CDR(modules);
+        dlclose(handle);
+        return error;
+    }
+
+    *result = scope;
+    return CAPSULE_ERROR_NONE;
+}
@@ -16,7 +16,12 @@
  */
 
 #include "capsule.h"
+#include "priv.h"
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 const char* Capsule_Error_str(CapsuleError error) {
     switch (error) {
@@ -32,54 +37,417 @@ const char* Capsule_Error_str(CapsuleError error) {
         return "Unbounded value";
     case CAPSULE_ERROR_RUNTIME:
         return "Runtime Error";
+    case CAPSULE_ERROR_EOF:
+        return "End of input";
     default:
         return "Unknown Error";
     }
 }
 
-void Capsule_print(Capsule atom, FILE* out) {
-    switch (atom.type) {
-    case CAPSULE_TYPE_NIL:
-        fprintf(out, "NIL");
-        break;
-    case CAPSULE_TYPE_PAIR:
-        fputc('(', out);
-        Capsule_print(CAPSULE_CAR(atom), out);
-        atom = CAPSULE_CDR(atom);
-        while (!CAPSULE_NILP(atom)) {
-            if (atom.type == CAPSULE_TYPE_PAIR) {
-                fputc(' ', out);
-                Capsule_print(CAPSULE_CAR(atom), out);
-                atom = CAPSULE_CDR(atom);
-            } else {
-                fprintf(out, " . ");
-                Capsule_print(atom, out);
+/*
+ * The printer formats into a buffer and walks lists with an explicit stack,
+ * so deep nesting costs heap and not C stack. A printer either flushes its
+ * buffer to a file or fills a caller buffer and counts what did not fit.
+ */
+
+#define PRINTER_BUFFER 4096
+#define PRINTER_STACK 64
+
+typedef struct {
+    char* data;
+    size_t capacity;
+    size_t used;
+    size_t spilled; /* flushed to the file or past the end of the caller buffer */
+    FILE* out;
+} Printer;
+
+static void printer_flush(Printer* p) {
+    if (p->out != NULL && p->used) {
+        fwrite(p->data, 1, p->used, p->out);
+        p->spilled += p->used;
+        p->used = 0;
+    }
+}
+
+static void put(Printer* p, const char* str, size_t size) {
+    if (p->capacity - p->used < size) {
+        printer_flush(p);
+        if (p->out != NULL && size > p->capacity) {
+            fwrite(str, 1, size, p->out);
+            p->spilled += size;
+            return;
+        }
+    }
+
+    size_t count = p->capacity - p->used < size ? p->capacity - p->used : size;
+    memcpy(p->data + p->used, str, count);
+    p->used += count;
+    p->spilled += size - count;
+}
+
+static size_t format_integer(long integer, char* out) {
+    char digits[24];
+    char* iter = digits + sizeof(digits);
+    unsigned long value = integer < 0 ? -(unsigned long)integer : (unsigned long)integer;
+
+    do {
+        *--iter = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    if (integer < 0)
+        *--iter = '-';
+
+    size_t size = digits + sizeof(digits) - iter;
+    memcpy(out, iter, size);
+    return size;
+}
+
+/*
+ * Grisu2 (Loitsch, "Printing Floating-Point Numbers Quickly and Accurately
+ * with Integers"), the digits always read back as the same double and are
+ * the shortest such digits for nearly every input.
+ */
+
+typedef struct {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+/* 10^k for k = -348, -340, ..., 340 as normalized 64 bit significands */
+static const DiyFp CACHED_POWERS[] = {
+    {0xfa8fd5a0081c0288, -1220}, {0xbaaee17fa23ebf76, -1193}, {0x8b16fb203055ac76, -1166},
+    {0xcf42894a5dce35ea, -1140}, {0x9a6bb0aa55653b2d, -1113}, {0xe61acf033d1a45df, -1087},
+    {0xab70fe17c79ac6ca, -1060}, {0xff77b1fcbebcdc4f, -1034}, {0xbe5691ef416bd60c, -1007},
+    {0x8dd01fad907ffc3c, -980}, {0xd3515c2831559a83, -954}, {0x9d71ac8fada6c9b5, -927},
+    {0xea9c227723ee8bcb, -901}, {0xaecc49914078536d, -874}, {0x823c12795db6ce57, -847},
+    {0xc21094364dfb5637, -821}, {0x9096ea6f3848984f, -794}, {0xd77485cb25823ac7, -768},
+    {0xa086cfcd97bf97f4, -741}, {0xef340a98172aace5, -715}, {0xb23867fb2a35b28e, -688},
+    {0x84c8d4dfd2c63f3b, -661}, {0xc5dd44271ad3cdba, -635}, {0x936b9fcebb25c996, -608},
+    {0xdbac6c247d62a584, -582}, {0xa3ab66580d5fdaf6, -555}, {0xf3e2f893dec3f126, -529},
+    {0xb5b5ada8aaff80b8, -502}, {0x87625f056c7c4a8b, -475}, {0xc9bcff6034c13053, -449},
+    {0x964e858c91ba2655, -422}, {0xdff9772470297ebd, -396}, {0xa6dfbd9fb8e5b88f, -369},
+    {0xf8a95fcf88747d94, -343}, {0xb94470938fa89bcf, -316}, {0x8a08f0f8bf0f156b, -289},
+    {0xcdb02555653131b6, -263}, {0x993fe2c6d07b7fac, -236}, {0xe45c10c42a2b3b06, -210},
+    {0xaa242499697392d3, -183}, {0xfd87b5f28300ca0e, -157}, {0xbce5086492111aeb, -130},
+    {0x8cbccc096f5088cc, -103}, {0xd1b71758e219652c, -77}, {0x9c40000000000000, -50},
+    {0xe8d4a51000000000, -24}, {0xad78ebc5ac620000, 3}, {0x813f3978f8940984, 30},
+    {0xc097ce7bc90715b3, 56}, {0x8f7e32ce7bea5c70, 83}, {0xd5d238a4abe98068, 109},
+    {0x9f4f2726179a2245, 136}, {0xed63a231d4c4fb27, 162}, {0xb0de65388cc8ada8, 189},
+    {0x83c7088e1aab65db, 216}, {0xc45d1df942711d9a, 242}, {0x924d692ca61be758, 269},
+    {0xda01ee641a708dea, 295}, {0xa26da3999aef774a, 322}, {0xf209787bb47d6b85, 348},
+    {0xb454e4a179dd1877, 375}, {0x865b86925b9bc5c2, 402}, {0xc83553c5c8965d3d, 428},
+    {0x952ab45cfa97a0b3, 455}, {0xde469fbd99a05fe3, 481}, {0xa59bc234db398c25, 508},
+    {0xf6c69a72a3989f5c, 534}, {0xb7dcbf5354e9bece, 561}, {0x88fcf317f22241e2, 588},
+    {0xcc20ce9bd35c78a5, 614}, {0x98165af37b2153df, 641}, {0xe2a0b5dc971f303a, 667},
+    {0xa8d9d1535ce3b396, 694}, {0xfb9b7cd9a4a7443c, 720}, {0xbb764c4ca7a44410, 747},
+    {0x8bab8eefb6409c1a, 774}, {0xd01fef10a657842c, 800}, {0x9b10a4e5e9913129, 827},
+    {0xe7109bfba19c0c9d, 853}, {0xac2820d9623bf429, 880}, {0x80444b5e7aa7cf85, 907},
+    {0xbf21e44003acdd2d, 933}, {0x8e679c2f5e44ff8f, 960}, {0xd433179d9c8cb841, 986},
+    {0x9e19db92b4e31ba9, 1013}, {0xeb96bf6ebadf77d9, 1039}, {0xaf87023b9bf0ee6b, 1066},
+};
+
+static const uint64_t POWERS_OF_10[] = {1ull,
+                                        10ull,
+                                        100ull,
+                                        1000ull,
+                                        10000ull,
+                                        100000ull,
+                                        1000000ull,
+                                        10000000ull,
+                                        100000000ull,
+                                        1000000000ull,
+                                        10000000000ull,
+                                        100000000000ull,
+                                        1000000000000ull,
+                                        10000000000000ull,
+                                        100000000000000ull,
+                                        1000000000000000ull,
+                                        10000000000000000ull,
+                                        100000000000000000ull,
+                                        1000000000000000000ull,
+                                        10000000000000000000ull};
+
+static DiyFp diyfp_multiply(DiyFp a, DiyFp b) {
+    unsigned __int128 product = (unsigned __int128)a.f * b.f;
+    uint64_t high = product >> 64, low = (uint64_t)product;
+    return (DiyFp){high + (low >> 63), a.e + b.e + 64};
+}
+
+static DiyFp diyfp_normalize(DiyFp v) {
+    int shift = __builtin_clzll(v.f);
+    return (DiyFp){v.f << shift, v.e - shift};
+}
+
+static void grisu_round(char* digits, int length, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w) {
+    while (rest < wp_w && delta - rest >= ten_kappa && (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        digits[length - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+static int grisu_digits(DiyFp w, DiyFp mp, uint64_t delta, char* digits, int* k) {
+    DiyFp one = {1ull << -mp.e, mp.e};
+    uint64_t wp_w = mp.f - w.f;
+    uint32_t p1 = mp.f >> -one.e;
+    uint64_t p2 = mp.f & (one.f - 1);
+    int kappa = 1, length = 0;
+
+    while (kappa < 10 && p1 >= POWERS_OF_10[kappa])
+        kappa++;
+
+    while (kappa > 0) {
+        uint32_t digit = p1 / POWERS_OF_10[kappa - 1];
+        p1 %= POWERS_OF_10[kappa - 1];
+        if (digit || length)
+            digits[length++] = '0' + digit;
+        kappa--;
+
+        uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+        if (rest <= delta) {
+            *k += kappa;
+            grisu_round(digits, length, delta, rest, POWERS_OF_10[kappa] << -one.e, wp_w);
+            return length;
+        }
+    }
+
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+        uint32_t digit = p2 >> -one.e;
+        if (digit || length)
+            digits[length++] = '0' + digit;
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta) {
+            *k += kappa;
+            grisu_round(digits, length, delta, p2, one.f, -kappa < 20 ? wp_w * POWERS_OF_10[-kappa] : 0);
+            return length;
+        }
+    }
+}
+
+/* digits of a finite positive double, the value is digits * 10^k */
+static int grisu2(double value, char* digits, int* k) {
+    uint64_t bits;
+    DiyFp v, plus, minus;
+
+    memcpy(&bits, &value, sizeof(bits));
+    int exponent = (bits >> 52) & 0x7FF;
+    v.f = bits & 0xFFFFFFFFFFFFFull;
+    if (exponent) {
+        v.f += 1ull << 52;
+        v.e = exponent - 1075;
+    } else {
+        v.e = -1074;
+    }
+
+    /* the boundaries halfway to the neighbouring doubles, closer below a power of two */
+    plus = diyfp_normalize((DiyFp){(v.f << 1) + 1, v.e - 1});
+    minus = v.f == 1ull << 52 ? (DiyFp){(v.f << 2) - 1, v.e - 2} : (DiyFp){(v.f << 1) - 1, v.e - 1};
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+
+    double dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+    int index = (int)dk;
+    if (dk - index > 0.0)
+        index++;
+    index = (index >> 3) + 1;
+    *k = -(-348 + index * 8);
+
+    DiyFp c = CACHED_POWERS[index];
+    DiyFp w = diyfp_multiply(diyfp_normalize(v), c);
+    plus = diyfp_multiply(plus, c);
+    minus = diyfp_multiply(minus, c);
+    minus.f++;
+    plus.f--;
+
+    return grisu_digits(w, plus, plus.f - minus.f, digits, k);
+}
+
+/*
+ * Fixed notation while the exponent is within %g's range and scientific
+ * beyond, always with a '.' so the reader sees a decimal again.
+ */
+static size_t format_decimal(double decimal, char* out) {
+    char digits[24];
+    size_t size = 0;
+    int k;
+
+    if (!isfinite(decimal))
+        return snprintf(out, 8, "%g", decimal);
+
+    if (signbit(decimal)) {
+        out[size++] = '-';
+        decimal = -decimal;
+    }
+    if (decimal == 0) {
+        memcpy(out + size, "0.0", 3);
+        return size + 3;
+    }
+
+    /* few fractional digits are found exactly, the scaled integer and the power of ten are both exact */
+    int length = 0;
+    if (decimal >= 1e-4 && decimal < 1e15) {
+        for (k = 0; k < 16; k++) {
+            double scaled = decimal * POWERS_OF_10[k];
+            if (scaled >= 9007199254740992.0)
+                break;
+
+            uint64_t integer = scaled + 0.5;
+            if ((double)integer / POWERS_OF_10[k] == decimal) {
+                char* iter = digits + sizeof(digits);
+                for (; integer; integer /= 10)
+                    *--iter = '0' + integer % 10;
+                length = digits + sizeof(digits) - iter;
+                memmove(digits, iter, length);
+                k = -k;
+                /* trailing zeros of an integral value move into the exponent */
+                while (length > 1 && digits[length - 1] == '0') {
+                    length--;
+                    k++;
+                }
                 break;
             }
         }
-        fputc(')', out);
-        break;
+    }
+    if (length == 0)
+        length = grisu2(decimal, digits, &k);
+    int point = length + k;
+
+    if (point > 0 && point <= 17) {
+        if (k >= 0) {
+            memcpy(out + size, digits, length);
+            memset(out + size + length, '0', k);
+            memcpy(out + size + point, ".0", 2);
+            return size + point + 2;
+        }
+        memcpy(out + size, digits, point);
+        out[size + point] = '.';
+        memcpy(out + size + point + 1, digits + point, length - point);
+        return size + length + 1;
+    }
+
+    if (point <= 0 && point > -4) {
+        memcpy(out + size, "0.", 2);
+        memset(out + size + 2, '0', -point);
+        memcpy(out + size + 2 - point, digits, length);
+        return size + 2 - point + length;
+    }
+
+    out[size++] = digits[0];
+    out[size++] = '.';
+    if (length == 1) {
+        out[size++] = '0';
+    } else {
+        memcpy(out + size, digits + 1, length - 1);
+        size += length - 1;
+    }
+    return size + snprintf(out + size, 8, "e%+03d", point - 1);
+}
+
+static void print_atom(Printer* p, Capsule atom) {
+    char buffer[64];
+    size_t size;
+
+    switch (atom.type) {
+    case CAPSULE_TYPE_NIL:
+        put(p, "NIL", 3);
+        return;
     case CAPSULE_TYPE_STRING:
     case CAPSULE_TYPE_SYMBOL:
-        fprintf(out, "%s", atom.as.symbol);
-        break;
+        put(p, atom.as.symbol, strlen(atom.as.symbol));
+        return;
     case CAPSULE_TYPE_INTEGER:
-        fprintf(out, "%ld", atom.as.integer);
+        size = format_integer(atom.as.integer, buffer);
         break;
     case CAPSULE_TYPE_DECIMAL:
-        fprintf(out, "%lf", atom.as.decimal);
+        size = format_decimal(atom.as.decimal, buffer);
         break;
     case CAPSULE_TYPE_POINTER:
-        fprintf(out, "%p", atom.as.pointer);
+        size = snprintf(buffer, sizeof(buffer), "%p", atom.as.pointer);
         break;
     case CAPSULE_TYPE_BUILTIN:
-        fprintf(out, "#<BUILTIN:%p>", atom.as.builtin);
+        size = snprintf(buffer, sizeof(buffer), "#<BUILTIN:%p>", atom.as.builtin);
         break;
     case CAPSULE_TYPE_CLOSURE:
-        fprintf(out, "#<CLOSURE:%p>", atom.as.pair);
+        size = snprintf(buffer, sizeof(buffer), "#<CLOSURE:%p>", atom.as.pair);
         break;
     case CAPSULE_TYPE_MACRO:
-        fprintf(out, "#<MACRO:%p>", atom.as.pair);
+        size = snprintf(buffer, sizeof(buffer), "#<MACRO:%p>", atom.as.pair);
         break;
+    default:
+        return;
+    }
+    put(p, buffer, size);
+}
+
+/* the stack holds the unprinted rest of every open list */
+static void print(Printer* p, Capsule atom) {
+    Capsule initial[PRINTER_STACK];
+    Capsule* stack = initial;
+    size_t depth = 0, capacity = PRINTER_STACK;
+
+    for (;;) {
+        while (atom.type == CAPSULE_TYPE_PAIR) {
+            if (depth == capacity) {
+                Capsule* grown = malloc(capacity * 2 * sizeof(Capsule));
+                if (grown == NULL)
+                    goto exit;
+                memcpy(grown, stack, depth * sizeof(Capsule));
+                if (stack != initial)
+                    free(stack);
+                stack = grown;
+                capacity *= 2;
+            }
+            put(p, "(", 1);
+            stack[depth++] = CAPSULE_CDR(atom);
+            atom = CAPSULE_CAR(atom);
+        }
+        print_atom(p, atom);
+
+        for (;;) {
+            if (depth == 0)
+                goto exit;
+
+            Capsule rest = stack[depth - 1];
+            /* a call scope prints without the profiler's marker */
+            if (rest.type == CAPSULE_TYPE_PAIR && profile_bindingp(CAPSULE_CAR(rest))) {
+                stack[depth - 1] = CAPSULE_CDR(rest);
+                continue;
+            }
+            if (rest.type == CAPSULE_TYPE_PAIR) {
+                put(p, " ", 1);
+                stack[depth - 1] = CAPSULE_CDR(rest);
+                atom = CAPSULE_CAR(rest);
+                break;
+            }
+            if (!CAPSULE_NILP(rest)) {
+                put(p, " . ", 3);
+                print_atom(p, rest);
+            }
+            put(p, ")", 1);
+            depth--;
+        }
     }
+
+exit:
+    if (stack != initial)
+        free(stack);
+}
+
+void Capsule_print(Capsule atom, FILE* out) {
+    char buffer[PRINTER_BUFFER];
+    Printer printer = {.data = buffer, .capacity = sizeof(buffer), .out = out};
+
+    print(&printer, atom);
+    printer_flush(&printer);
+}
+
+size_t Capsule_print_to_buffer(Capsule atom, char* buffer, size_t size) {
+    Printer printer = {.data = buffer, .capacity = size ? size - 1 : 0};
+
+    print(&printer, atom);
+    if (size)
+        buffer[printer.used] = '\0';
+    return printer.used + printer.spilled;
 }
@@ -2,15 +2,256 @@
 #define CAPSULE_PRIV_H
 
 #include "capsule.h"
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+
+#define GC_FROZEN (-1)
+#define GC_REMEMBERED (-2)
+
+typedef struct Allocation {
+    int mark;
+    CapsuleType type;
+    struct Allocation* next;
+    void (*deallocate)(void*);
+    void* pointer;
+} Allocation;
+
+typedef struct Task Task;
+
+/* roots of an active Capsule_eval_cap, innermost first */
+typedef struct EvalState {
+    Capsule* expr;
+    Capsule* scope;
+    Capsule* stack;
+    Capsule* result;
+    const Capsule* values; /* COUNT more roots held in C, the argument tuples a batch has yet to apply */
+    size_t count;
+    Capsule escapes; /* cells of the escape continuations live on the running stack, innermost first */
+    struct EvalState* parent;
+    Task* task;    /* spawned task running in the loop, NULL while its own evaluation runs */
+    Task* owner;   /* its own evaluation once that has blocked */
+    int suspended; /* set by a blocking builtin, the loop switches tasks */
+} EvalState;
+
+extern EvalState* eval_state;
 
 void gc_mark(Capsule root);
 
+/* totals since startup, TIME reports the difference around an expression */
+typedef struct {
+    size_t steps;       /* iterations of the evaluation loop */
+    size_t allocated;   /* bytes, headers included */
+    size_t collections;
+    uint64_t gc_ns;
+} RuntimeStats;
+
+extern RuntimeStats runtime_stats;
+
+/* evaluator counters and the trace hook, nothing at all without EVAL_STATS */
+#ifdef EVAL_STATS
+extern CapsuleStats eval_stats;
+
+extern CapsuleTraceHook trace_hook;
+
+extern void* trace_data;
+
+#    define EVAL_COUNT(counter) (eval_stats.counter++)
+#    define EVAL_TRACE(event, fn, value) (trace_hook != NULL ? trace_hook(event, fn, value, trace_data) : (void)0)
+#    define EVAL_TRACING (trace_hook != NULL)
+#else
+#    define EVAL_COUNT(counter) ((void)0)
+#    define EVAL_TRACE(event, fn, value) ((void)0)
+#    define EVAL_TRACING 0
+#endif
+
 void gc();
 
+void gc_maybe();
+
+void gc_protect(Capsule* root);
+
+void gc_freeze(Capsule root);
+
+int gc_frozenp(Capsule cap);
+
+int gc_collectablep(Capsule cap);
+
+void gc_write_barrier(Capsule cap);
+
+Capsule symbol_intern(Capsule symbol);
+
+Capsule symbol_intern_n(const char* s, size_t n, int fold);
+
+char* string_alloc(size_t size, Capsule* result);
+
+Allocation* string_grow(Allocation* alloc, size_t capacity);
+
+char* string_finish(Allocation* alloc, size_t size, Capsule* result);
+
+Capsule managed_pointer_new(void* pointer, void (*deallocate)(void*), void* context, Capsule data);
+
+int managed_pointerp(Capsule cap, void (*deallocate)(void*));
+
+const char* scan_whitespace(const char* p);
+
+const char* scan_delimiter(const char* p);
+
+const char* scan_string(const char* p);
+
 char* slurp(const char* path);
 
-void load_file(Capsule env, const char* path);
+char* map_file(const char* path, size_t offset, size_t* size, size_t* length);
+
+void unmap_file(char* base, size_t length);
+
+uint64_t clock_ns(clockid_t clock);
+
+CapsuleError string_map(const char* path, Capsule* result);
 
 void define_builtin(Capsule scope);
 
+const char* builtin_name(CapsuleBuiltin builtin);
+
+CapsuleBuiltin builtin_lookup(const char* symbol);
+
+void scope_global_init(Capsule scope);
+
+typedef CapsuleError (*FormSource)(void* source, Capsule* result);
+
+CapsuleError eval_forms(FormSource next, void* source, Capsule scope, Capsule* result);
+
+CapsuleError eval_capture(Capsule proc, int escape, Capsule scope, Capsule* result);
+
+Capsule native_closure(CapsuleBuiltin builtin, Capsule data, Capsule scope);
+
+CapsuleError native_closure_args(Capsule args, Capsule scope, Capsule* data, Capsule* values);
+
+CapsuleError load_file(const char* path, int cache, Capsule scope, Capsule* result);
+
+CapsuleError fasl_eval(const char* path, const char* source, size_t size, Capsule scope, Capsule* result);
+
+CapsuleError csv_read(FILE* file, Capsule* result);
+
+CapsuleError csv_write(FILE* file, Capsule record);
+
+typedef struct {
+    FILE* file;
+    int state;
+} JsonStream;
+
+CapsuleError json_read(FILE* file, Capsule* result);
+
+void json_stream_init(JsonStream* stream, FILE* file);
+
+CapsuleError json_stream_next(void* stream, Capsule* result);
+
+CapsuleError json_write(FILE* file, Capsule value);
+
+void sched_mark();
+
+void escapes_clear(Capsule* escapes);
+
+CapsuleError sched_switch(EvalState* loop, Capsule* stack, Capsule* scope, Capsule* expr);
+
+CapsuleError sched_finish(EvalState* loop, Capsule* stack, Capsule* scope, Capsule* expr);
+
+CapsuleError sched_fail(EvalState* loop, CapsuleError error, Capsule* stack, Capsule* scope, Capsule* expr);
+
+void sched_leave(EvalState* loop);
+
+CapsuleError sched_run(Capsule scope);
+
+long sched_spawn(Capsule call, Capsule scope);
+
+CapsuleError sched_join(long id, Capsule* result);
+
+CapsuleError sched_yield(Capsule* result);
+
+CapsuleError sched_sleep(double seconds, Capsule* result);
+
+size_t stream_pending(FILE* file);
+
+int stream_used(FILE* file);
+
+CapsuleError sched_await(int fd, int writable, Capsule* result);
+
+Capsule sched_channel(long capacity);
+
+int sched_channelp(Capsule channel);
+
+CapsuleError sched_send(Capsule channel, Capsule value, Capsule* result);
+
+CapsuleError sched_receive(Capsule channel, Capsule* result);
+
+void sched_close(Capsule channel);
+
+/* buffer views, :PTR (CAPSULE_TYPE_POINTER) is accepted as well */
+typedef enum {
+    BUFFER_U8 = 16,
+    BUFFER_I8,
+    BUFFER_U16,
+    BUFFER_I16,
+    BUFFER_U32,
+    BUFFER_I32,
+    BUFFER_U64,
+    BUFFER_I64,
+    BUFFER_F32,
+    BUFFER_F64,
+} BufferView;
+
+CapsuleError buffer_new(size_t size, Capsule* result);
+
+int buffer_data(Capsule buffer, unsigned char** data, size_t* size);
+
+size_t buffer_view_size(long view);
+
+CapsuleError buffer_ref(Capsule buffer, long view, long offset, Capsule* result);
+
+CapsuleError buffer_set(Capsule buffer, long view, long offset, Capsule value);
+
+CapsuleError view_load(long view, const void* element, Capsule* result);
+
+CapsuleError view_store(long view, void* element, Capsule value);
+
+CapsuleError buffer_layout(Capsule views, Capsule* result);
+
+CapsuleError module_require(const char* id, Capsule* result);
+
+extern volatile sig_atomic_t profile_pending;
+
+extern int profile_active;
+
+extern Capsule profile_marker;
+
+/* scopes record their closure while the profiler runs, for the whole run when allocations are profiled */
+#ifdef PROFILE_ALLOC
+#    define PROFILE_SCOPES 1
+#else
+#    define PROFILE_SCOPES profile_active
+#endif
+
+/* whether BINDING is the marker a call scope gets while profiling */
+int profile_bindingp(Capsule binding);
+
+void profile_define(Capsule symbol, Capsule value);
+
+void profile_sample();
+
+CapsuleError profile_start(const char* path, Capsule scope);
+
+CapsuleError profile_stop(size_t* count);
+
+#ifdef PROFILE_ALLOC
+void profile_allocation(CapsuleType type, size_t size);
+
+void profile_allocations_write(FILE* out);
+
+Capsule profile_allocations();
+#endif
+
+CapsuleError image_write(FILE* out, Capsule root);
+
+CapsuleError image_load(void* image, size_t size, Capsule* root);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,471 @@
+/*
+ * Copyright (c) 2024 Manjeet Singh <itsmanjeet1998@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Sampling profiler
+ *
+ * SIGPROF only raises a flag, the evaluation loop takes the sample at its
+ * next step where the heap is consistent. A sample walks the frames of every
+ * active loop and names each closure by the symbol it was defined under,
+ * taken from the scope when profiling starts and at every DEFINE after. The
+ * scope of every call also gets a last binding to its closure so the frames
+ * left after a tail call are still attributed. Samples are counted per folded
+ * stack and written as "outer;inner count" lines for flamegraph tools.
+ */
+
+#include "priv.h"
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define PROFILE_INTERVAL_US 1000
+#define PROFILE_MAX_DEPTH 256
+#define PROFILE_MAX_STACK 4096
+
+volatile sig_atomic_t profile_pending = 0;
+int profile_active = 0;
+Capsule profile_marker = {CAPSULE_TYPE_NIL};
+
+/* keyed by closure body, shared by every closure made from the same lambda */
+typedef struct {
+    void* key;
+    const char* name;
+} ProfileName;
+
+static ProfileName* names = NULL;
+static size_t names_capacity = 0;
+static size_t names_count = 0;
+
+/* keeps the recorded bodies alive so their addresses are never reused */
+static Capsule bodies = {CAPSULE_TYPE_NIL};
+
+typedef struct {
+    char* stack;
+    size_t count;
+} ProfileStack;
+
+static ProfileStack* stacks = NULL;
+static size_t stacks_capacity = 0;
+static size_t stacks_count = 0;
+static size_t samples = 0;
+
+static FILE* output = NULL;
+
+static const char unnamed[] = "(lambda)";
+
+static size_t pointer_hash(void* p) {
+    return ((uintptr_t)p >> 4) * 11400714819323198485ull;
+}
+
+static size_t string_hash(const char* s) {
+    size_t hash = 14695981039346656037ull;
+    for (; *s; s++) {
+        hash ^= (unsigned char)*s;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static ProfileName* name_slot(ProfileName* table, size_t capacity, void* body) {
+    size_t slot = pointer_hash(body) & (capacity - 1);
+    while (table[slot].key != NULL && table[slot].key != body)
+        slot = (slot + 1) & (capacity - 1);
+    return &table[slot];
+}
+
+/* nonzero when KEY was not named before */
+static int name_insert(void* key, const char* name) {
+    if ((names_count + 1) * 2 > names_capacity) {
+        size_t capacity = names_capacity ? names_capacity * 2 : 256;
+        ProfileName* table = calloc(capacity, sizeof(ProfileName));
+        for (size_t i = 0; i < names_capacity; i++)
+            if (names[i].key != NULL)
+                *name_slot(table, capacity, names[i].key) = names[i];
+        free(names);
+        names = table;
+        names_capacity = capacity;
+    }
+
+    ProfileName* entry = name_slot(names, names_capacity, key);
+    int inserted = entry->key == NULL;
+    if (inserted) {
+        names_count++;
+        entry->key = key;
+    }
+    entry->name = name;
+    return inserted;
+}
+
+void profile_define(Capsule symbol, Capsule value) {
+    if (!PROFILE_SCOPES)
+        return;
+    if ((value.type != CAPSULE_TYPE_CLOSURE && value.type != CAPSULE_TYPE_MACRO) || symbol.type != CAPSULE_TYPE_SYMBOL)
+        return;
+
+    Capsule body = CAPSULE_CDR(CAPSULE_CDR(value));
+    if (body.type != CAPSULE_TYPE_PAIR)
+        return;
+
+    if (name_insert(body.as.pair, symbol.as.symbol))
+        bodies = CAPSULE_CONS(body, bodies);
+}
+
+/* NULL when CLOSURE is not one */
+static const char* closure_name(Capsule closure) {
+    if (closure.type != CAPSULE_TYPE_CLOSURE && closure.type != CAPSULE_TYPE_MACRO)
+        return NULL;
+    Capsule body = CAPSULE_CDR(CAPSULE_CDR(closure));
+    if (names_count > 0 && body.type == CAPSULE_TYPE_PAIR) {
+        ProfileName* entry = name_slot(names, names_capacity, body.as.pair);
+        if (entry->key != NULL)
+            return entry->name;
+    }
+    return unnamed;
+}
+
+int profile_bindingp(Capsule binding) {
+    return binding.type == CAPSULE_TYPE_PAIR && CAPSULE_CAR(binding).type == CAPSULE_TYPE_SYMBOL &&
+           CAPSULE_CAR(binding).as.symbol == profile_marker.as.symbol;
+}
+
+/* the closure a call scope was made for, the marker is its last binding */
+static int scope_closure(Capsule scope, Capsule* closure) {
+    Capsule bs, last = Capsule_nil;
+
+    if (scope.type != CAPSULE_TYPE_PAIR)
+        return 0;
+    for (bs = CAPSULE_CDR(scope); bs.type == CAPSULE_TYPE_PAIR; bs = CAPSULE_CDR(bs))
+        last = CAPSULE_CAR(bs);
+    if (!profile_bindingp(last))
+        return 0;
+
+    *closure = CAPSULE_CDR(last);
+    return 1;
+}
+
+static void stack_count(const char* stack) {
+    if ((stacks_count + 1) * 2 > stacks_capacity) {
+        size_t capacity = stacks_capacity ? stacks_capacity * 2 : 256;
+        ProfileStack* table = calloc(capacity, sizeof(ProfileStack));
+        for (size_t i = 0; i < stacks_capacity; i++) {
+            if (stacks[i].stack == NULL)
+                continue;
+            size_t slot = string_hash(stacks[i].stack) & (capacity - 1);
+            while (table[slot].stack != NULL)
+                slot = (slot + 1) & (capacity - 1);
+            table[slot] = stacks[i];
+        }
+        free(stacks);
+        stacks = table;
+        stacks_capacity = capacity;
+    }
+
+    size_t slot = string_hash(stack) & (stacks_capacity - 1);
+    while (stacks[slot].stack != NULL && strcmp(stacks[slot].stack, stack) != 0)
+        slot = (slot + 1) & (stacks_capacity - 1);
+    if (stacks[slot].stack == NULL) {
+        stacks[slot].stack = strdup(stack);
+        stacks_count++;
+    }
+    stacks[slot].count++;
+}
+
+void profile_sample() {
+    const char* frames[PROFILE_MAX_DEPTH];
+    char stack[PROFILE_MAX_STACK];
+    void* last = NULL;
+    size_t depth = 0, n = 0;
+    Capsule closure;
+
+    profile_pending = 0;
+    if (!profile_active)
+        return;
+
+    /* innermost first, a closure's scope is shared by the frames of its body */
+    for (EvalState* state = eval_state; state != NULL && depth < PROFILE_MAX_DEPTH; state = state->parent) {
+        if (state->scope == NULL || state->stack == NULL)
+            continue;
+        Capsule scope = *state->scope;
+        for (Capsule frame = *state->stack;; frame = CAPSULE_CAR(frame)) {
+            if (scope.type == CAPSULE_TYPE_PAIR && scope.as.pair != last && scope_closure(scope, &closure)) {
+                frames[depth++] = closure_name(closure);
+                last = scope.as.pair;
+            }
+            if (CAPSULE_NILP(frame) || depth == PROFILE_MAX_DEPTH)
+                break;
+            scope = CAPSULE_CAR(CAPSULE_CDR(frame));
+        }
+    }
+
+    if (depth == 0)
+        frames[depth++] = "(toplevel)";
+    while (depth-- > 0 && n < sizeof(stack) - 1) {
+        int written = snprintf(stack + n, sizeof(stack) - n, "%s%s", frames[depth], depth ? ";" : "");
+        n += written > 0 ? (size_t)written : 0;
+    }
+
+    samples++;
+    stack_count(stack);
+}
+
+static void profile_signal(int signal) {
+    (void)signal;
+    profile_pending = 1;
+}
+
+/* names what the image loaded, those were defined in another process, the marker names nothing */
+static void profile_scan(Capsule scope) {
+    for (; scope.type == CAPSULE_TYPE_PAIR; scope = CAPSULE_CAR(scope))
+        for (Capsule bs = CAPSULE_CDR(scope); bs.type == CAPSULE_TYPE_PAIR; bs = CAPSULE_CDR(bs))
+            if (!profile_bindingp(CAPSULE_CAR(bs)) && closure_name(CAPSULE_CDR(CAPSULE_CAR(bs))) == unnamed)
+                profile_define(CAPSULE_CAR(CAPSULE_CAR(bs)), CAPSULE_CDR(CAPSULE_CAR(bs)));
+}
+
+static void profile_init() {
+    static int initialized = 0;
+
+    if (!initialized++) {
+        profile_marker = CAPSULE_SYMBOL("%PROFILE-CLOSURE");
+        gc_protect(&bodies);
+    }
+}
+
+static void profile_exit() {
+    size_t count;
+    profile_stop(&count);
+}
+
+CapsuleError profile_start(const char* path, Capsule scope) {
+    static int registered = 0;
+    struct sigaction action = {.sa_handler = profile_signal, .sa_flags = SA_RESTART};
+    struct itimerval timer = {{0, PROFILE_INTERVAL_US}, {0, PROFILE_INTERVAL_US}};
+
+    if (profile_active)
+        return CAPSULE_ERROR_RUNTIME;
+    if ((output = fopen(path, "w")) == NULL) {
+        perror(path);
+        return CAPSULE_ERROR_RUNTIME;
+    }
+
+    profile_init();
+    if (!registered++)
+        atexit(profile_exit);
+
+    samples = 0;
+    profile_active = 1;
+    profile_scan(scope);
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, NULL);
+    setitimer(ITIMER_PROF, &timer, NULL);
+    return CAPSULE_ERROR_NONE;
+}
+
+/* writes the folded stacks and drops them, COUNT is the number of samples taken */
+CapsuleError profile_stop(size_t* count) {
+    struct itimerval timer = {{0, 0}, {0, 0}};
+
+    if (!profile_active)
+        return CAPSULE_ERROR_RUNTIME;
+
+    setitimer(ITIMER_PROF, &timer, NULL);
+    signal(SIGPROF, SIG_IGN);
+    profile_active = 0;
+    profile_pending = 0;
+
+    for (size_t i = 0; i < stacks_capacity; i++) {
+        if (stacks[i].stack == NULL)
+            continue;
+        fprintf(output, "%s %zu\n", stacks[i].stack, stacks[i].count);
+        free(stacks[i].stack);
+    }
+    fclose(output);
+    output = NULL;
+
+    free(stacks);
+    stacks = NULL;
+    stacks_capacity = stacks_count = 0;
+
+#ifndef PROFILE_ALLOC
+    free(names);
+    names = NULL;
+    names_capacity = names_count = 0;
+    bodies = Capsule_nil;
+#endif
+    *count = samples;
+    return CAPSULE_ERROR_NONE;
+}
+
+#ifdef PROFILE_ALLOC
+/*
+ * Allocation profiler
+ *
+ * Every PROFILE_ALLOC_INTERVAL bytes allocated (CAPSULE_ALLOC_SAMPLE
+ * overrides it) the allocation crossing the mark is charged the intervals
+ * it completes, so bytes and counts per site are estimates that grow exact with
+ * a smaller interval. A site is the expression the innermost loop is
+ * evaluating, so a builtin's allocations land on its call, after the name of
+ * the closure evaluating it. Scopes carry their closure for the whole run in
+ * this build. The report is written at exit to CAPSULE_ALLOC_PROFILE, or
+ * stderr.
+ */
+
+#    define PROFILE_ALLOC_INTERVAL 16384
+#    define PROFILE_ALLOC_SITE 128
+
+typedef struct {
+    char* site;
+    CapsuleType type;
+    size_t samples;
+    double count;
+} ProfileSite;
+
+static ProfileSite* sites = NULL;
+static size_t sites_capacity = 0;
+static size_t sites_count = 0;
+
+static size_t alloc_interval = 0;
+static size_t alloc_bytes = 0;
+static int alloc_reporting = 0;
+static int alloc_scanned = 0;
+
+static const char* const type_names[] = {"NIL",     "PAIR",    "SYMBOL",  "STRING",  "INTEGER",
+                                         "DECIMAL", "POINTER", "BUILTIN", "CLOSURE", "MACRO"};
+
+static ProfileSite* site_slot(ProfileSite* table, size_t capacity, const char* site, CapsuleType type) {
+    size_t slot = (string_hash(site) ^ type) & (capacity - 1);
+    while (table[slot].site != NULL && (table[slot].type != type || strcmp(table[slot].site, site) != 0))
+        slot = (slot + 1) & (capacity - 1);
+    return &table[slot];
+}
+
+static void profile_allocation_exit() {
+    const char* path = getenv("CAPSULE_ALLOC_PROFILE");
+    FILE* out = path ? fopen(path, "w") : stderr;
+
+    if (out == NULL) {
+        perror(path);
+        return;
+    }
+    profile_allocations_write(out);
+    if (out != stderr)
+        fclose(out);
+}
+
+void profile_allocation(CapsuleType type, size_t size) {
+    char site[PROFILE_ALLOC_SITE];
+    size_t samples, n = 0;
+    Capsule closure;
+
+    if (alloc_interval == 0) {
+        const char* interval = getenv("CAPSULE_ALLOC_SAMPLE");
+        alloc_interval = interval && atol(interval) > 0 ? (size_t)atol(interval) : PROFILE_ALLOC_INTERVAL;
+        profile_init();
+        atexit(profile_allocation_exit);
+    }
+
+    size += sizeof(Allocation);
+    if ((alloc_bytes += size) < alloc_interval || alloc_reporting)
+        return;
+    samples = alloc_bytes / alloc_interval;
+    alloc_bytes %= alloc_interval;
+
+    if (eval_state == NULL || eval_state->expr == NULL) {
+        snprintf(site, sizeof(site), "(native)");
+    } else {
+        /* the runtime and an image were defined before the first sample */
+        if (!alloc_scanned++)
+            profile_scan(*eval_state->scope);
+        Capsule scope = *eval_state->scope, expr = *eval_state->expr;
+        n = snprintf(site, sizeof(site), "%s ", scope_closure(scope, &closure) ? closure_name(closure) : "(toplevel)");
+        /* a builtin is applied to the values of its arguments, those are no site */
+        if (expr.type == CAPSULE_TYPE_PAIR && CAPSULE_CAR(expr).type == CAPSULE_TYPE_BUILTIN) {
+            const char* name = builtin_name(CAPSULE_CAR(expr).as.builtin);
+            snprintf(site + n, sizeof(site) - n, "(%s ...)", name ? name : "#<BUILTIN>");
+        } else if (Capsule_print_to_buffer(expr, site + n, sizeof(site) - n) >= sizeof(site) - n) {
+            memcpy(site + sizeof(site) - 4, "...", 4);
+        }
+    }
+
+    if ((sites_count + 1) * 2 > sites_capacity) {
+        size_t capacity = sites_capacity ? sites_capacity * 2 : 256;
+        ProfileSite* table = calloc(capacity, sizeof(ProfileSite));
+        for (size_t i = 0; i < sites_capacity; i++)
+            if (sites[i].site != NULL)
+                *site_slot(table, capacity, sites[i].site, sites[i].type) = sites[i];
+        free(sites);
+        sites = table;
+        sites_capacity = capacity;
+    }
+
+    ProfileSite* entry = site_slot(sites, sites_capacity, site, type);
+    if (entry->site == NULL) {
+        entry->site = strdup(site);
+        entry->type = type;
+        sites_count++;
+    }
+    entry->samples += samples;
+    entry->count += (double)(samples * alloc_interval) / size;
+}
+
+static int site_compare(const void* a, const void* b) {
+    const ProfileSite *x = *(const ProfileSite* const*)a, *y = *(const ProfileSite* const*)b;
+    return (x->samples < y->samples) - (x->samples > y->samples);
+}
+
+/* the sites by bytes allocated, largest first */
+static ProfileSite** sites_sorted() {
+    ProfileSite** sorted = malloc((sites_count + 1) * sizeof(ProfileSite*));
+    size_t n = 0;
+
+    for (size_t i = 0; i < sites_capacity; i++)
+        if (sites[i].site != NULL)
+            sorted[n++] = &sites[i];
+    qsort(sorted, n, sizeof(ProfileSite*), site_compare);
+    return sorted;
+}
+
+void profile_allocations_write(FILE* out) {
+    ProfileSite** sorted = sites_sorted();
+
+    fprintf(out, "%12s %10s %-8s %s\n", "bytes", "count", "type", "site");
+    for (size_t i = 0; i < sites_count; i++)
+        fprintf(out, "%12zu %10.0f %-8s %s\n", sorted[i]->samples * alloc_interval, sorted[i]->count,
+                type_names[sorted[i]->type], sorted[i]->site);
+    free(sorted);
+}
+
+/* ((site type count bytes) ...) largest first, what the report has so far */
+Capsule profile_allocations() {
+    ProfileSite** sorted = sites_sorted();
+    Capsule report = Capsule_nil;
+
+    alloc_reporting = 1;
+    for (size_t i = sites_count; i-- > 0;) {
+        ProfileSite* s = sorted[i];
+        Capsule entry = CAPSULE_CONS(CAPSULE_INTEGER((long)(s->samples * alloc_interval)), Capsule_nil);
+        entry = CAPSULE_CONS(CAPSULE_INTEGER((long)s->count), entry);
+        entry = CAPSULE_CONS(CAPSULE_SYMBOL(type_names[s->type]), entry);
+        report = CAPSULE_CONS(CAPSULE_CONS(CAPSULE_STRING(s->site), entry), report);
+    }
+    alloc_reporting = 0;
+
+    free(sorted);
+    return report;
+}
+#endif
@@ -16,115 +16,132 @@
  */
 
 #include "capsule.h"
+#include "priv.h"
 #include <ctype.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
 static CapsuleError read(const char* input, const char** end, Capsule* result);
 
+/* CAPSULE_ERROR_EOF with START NULL when no token is left, at the token when it is cut off by the end */
 static CapsuleError lex(const char* str, const char** start, const char** end) {
-    const char* ws = " \t\n";
-    const char* delim = "(){}[]; \t\n";
-    const char* prefix = "(){}[]\'`";
-
-    str += strspn(str, ws);
+    for (str = scan_whitespace(str); str[0] == ';'; str = scan_whitespace(str)) {
+        str = strchr(str, '\n');
+        if (!str) {
+            *start = *end = NULL;
+            return CAPSULE_ERROR_EOF;
+        }
+    }
 
     if (str[0] == '\0') {
         *start = *end = NULL;
-        return CAPSULE_ERROR_SYNTAX;
+        return CAPSULE_ERROR_EOF;
     }
 
     *start = str;
 
-    if (strchr(prefix, str[0]) != NULL)
+    switch (str[0]) {
+    case '(':
+    case ')':
+    case '{':
+    case '}':
+    case '[':
+    case ']':
+    case '\'':
+    case '`':
         *end = str + 1;
-    else if (str[0] == ',')
+        break;
+    case ',':
         *end = str + (str[1] == '@' ? 2 : 1);
-    else if (str[0] == '"') {
-        *end = str + strcspn(str + 1, "\"") + 2;
-    } else if (str[0] == ';') {
-        str = strchr(str, '\n');
-        if (!str) {
-            *start = *end = NULL;
-            return CAPSULE_ERROR_SYNTAX;
+        break;
+    case '"':
+        *end = str + 1;
+        for (;;) {
+            *end = scan_string(*end);
+            if (**end == '"')
+                break;
+            if (**end == '\0' || (*end)[1] == '\0') {
+                *end = NULL;
+                return CAPSULE_ERROR_EOF;
+            }
+            *end += 2;
         }
-        return lex(str, start, end);
-    } else
-        *end = str + strcspn(str, delim);
+        ++*end;
+        break;
+    default:
+        *end = scan_delimiter(str);
+    }
 
     return CAPSULE_ERROR_NONE;
 }
 
 static CapsuleError parse_simple(const char* start, const char* end, Capsule* result) {
     const char* iter = start;
-    char* endptr;
     if (isdigit(*iter)) {
-        int is_decimal = 0;
-        while (isdigit(*iter))
-            *iter++;
-        if (*iter == '.') {
-            is_decimal = 1;
-            iter++;
-            while (isdigit(*iter))
-                *iter++;
+        long integer = 0;
+        int overflow = 0;
+        for (; iter != end && isdigit(*iter); iter++) {
+            int digit = *iter - '0';
+            /* the digits may still be a decimal's, too large only matters for an integer */
+            if (integer > (LONG_MAX - digit) / 10)
+                overflow = 1;
+            else
+                integer = integer * 10 + digit;
         }
 
-        if (is_decimal) {
+        if (iter != end && *iter == '.') {
+            char* endptr;
             *result = CAPSULE_DECIMAL(strtod(start, &endptr));
-        } else {
-            *result = CAPSULE_INTEGER(strtol(start, &endptr, 10));
+            return endptr == end ? CAPSULE_ERROR_NONE : CAPSULE_ERROR_SYNTAX;
         }
-        start = iter;
-        return endptr == end ? CAPSULE_ERROR_NONE : CAPSULE_ERROR_SYNTAX;
-    }
 
-    char* buffer = malloc(end - start + 1);
-    char* p = buffer;
-    while (start != end)
-        *p++ = toupper(*start), ++start;
-    *p = '\0';
+        *result = CAPSULE_INTEGER(integer);
+        return iter == end && !overflow ? CAPSULE_ERROR_NONE : CAPSULE_ERROR_SYNTAX;
+    }
 
-    if (strcmp(buffer, "NIL") == 0)
+    /* symbols are case folded while interning, straight from the source */
+    if (end - start == 3 && toupper(start[0]) == 'N' && toupper(start[1]) == 'I' && toupper(start[2]) == 'L')
         *result = Capsule_nil;
     else
-        *result = CAPSULE_SYMBOL(buffer);
-
-    free(buffer);
+        *result = symbol_intern_n(start, end - start, 1);
 
     return CAPSULE_ERROR_NONE;
 }
 
 static CapsuleError read_string(const char* start, const char* end, Capsule* result) {
-    size_t size = end - start - 2;
-    char* buffer = malloc(sizeof(char) * (size + 1));
-    for (int i = 1, j = 0; i <= size; ++i, ++j) {
-        if (start[i] == '\\') {
-            switch (start[++i]) {
-            case 'n':
-                buffer[j] = '\n';
-                break;
-            case 't':
-                buffer[j] = '\t';
-                break;
-            case 'f':
-                buffer[j] = '\f';
-                break;
-            case 'b':
-                buffer[j] = '\b';
-                break;
-            case 'a':
-                buffer[j] = '\a';
-                break;
-            default:
-                buffer[j] = start[i - 1];
-                break;
-            }
-        } else {
-            buffer[j] = start[i];
+    /* escapes only shrink the string, so the quoted length bounds it */
+    char* buffer = string_alloc(end - start - 2, result);
+    size_t j = 0;
+
+    for (const char* p = start + 1; p < end - 1; ++p, ++j) {
+        if (*p != '\\') {
+            buffer[j] = *p;
+            continue;
+        }
+
+        switch (*++p) {
+        case 'n':
+            buffer[j] = '\n';
+            break;
+        case 't':
+            buffer[j] = '\t';
+            break;
+        case 'f':
+            buffer[j] = '\f';
+            break;
+        case 'b':
+            buffer[j] = '\b';
+            break;
+        case 'a':
+            buffer[j] = '\a';
+            break;
+        default:
+            buffer[j] = *p;
+            break;
         }
     }
-    buffer[size] = '\0';
-    *result = CAPSULE_STRING(buffer);
+    buffer[j] = '\0';
     return CAPSULE_ERROR_NONE;
 }
 
@@ -214,5 +231,74 @@ CapsuleError read(const char* input, const char** end, Capsule* result) {
 
 CapsuleError Capsule_read(const char* source, Capsule* result) {
     const char* p = source;
-    return read(p, &p, result);
+    CapsuleError error = read(p, &p, result);
+    return error == CAPSULE_ERROR_EOF ? CAPSULE_ERROR_SYNTAX : error;
+}
+
+#define READER_CHUNK (BUFSIZ * 16)
+
+void Capsule_Reader_init_file(CapsuleReader* reader, FILE* file) {
+    memset(reader, 0, sizeof(*reader));
+    reader->file = file;
+    reader->source = "";
+}
+
+void Capsule_Reader_init_buffer(CapsuleReader* reader, const char* source) {
+    memset(reader, 0, sizeof(*reader));
+    reader->source = source;
+    reader->size = strlen(source);
+}
+
+void Capsule_Reader_close(CapsuleReader* reader) {
+    free(reader->buffer);
+    memset(reader, 0, sizeof(*reader));
+}
+
+static int reader_fill(CapsuleReader* reader) {
+    size_t count;
+
+    if (reader->file == NULL || feof(reader->file) || ferror(reader->file))
+        return 0;
+
+    /* drop consumed input, then grow so a form spanning many chunks is re-read only log(n) times */
+    reader->size -= reader->position;
+    memmove(reader->buffer, reader->buffer + reader->position, reader->size);
+    reader->position = 0;
+
+    if (reader->capacity < reader->size * 2 + READER_CHUNK + 1) {
+        size_t capacity = reader->size * 2 + READER_CHUNK + 1;
+        char* buffer = realloc(reader->buffer, capacity);
+        if (buffer == NULL)
+            return 0;
+        reader->buffer = buffer;
+        reader->capacity = capacity;
+    }
+
+    count = fread(reader->buffer + reader->size, 1, reader->capacity - reader->size - 1, reader->file);
+    reader->size += count;
+    reader->buffer[reader->size] = '\0';
+    reader->source = reader->buffer;
+    return count > 0 || !feof(reader->file);
+}
+
+CapsuleError Capsule_Reader_next(CapsuleReader* reader, Capsule* result) {
+    for (;;) {
+        const char* start = reader->source + reader->position;
+        const char* end = start;
+        CapsuleError error = read(start, &end, result);
+
+        /* a form touching the end of the buffer may continue in the next chunk */
+        if (error == CAPSULE_ERROR_EOF || (!error && end == reader->source + reader->size)) {
+            if (reader_fill(reader))
+                continue;
+            if (error) {
+                const char* token;
+                return lex(start, &token, &end) == CAPSULE_ERROR_EOF && token == NULL ? CAPSULE_ERROR_EOF : CAPSULE_ERROR_SYNTAX;
+            }
+        }
+
+        if (!error)
+            reader->position = end - reader->source;
+        return error;
+    }
 }
\ No newline at end of file
@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2024 Manjeet Singh <itsmanjeet1998@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Token boundary scanning for the reader
+ *
+ * Each scanner returns the first byte of a NUL terminated input in its stop
+ * set, the NUL itself is always a stop. The vector versions classify 16 or
+ * 32 bytes at a time using aligned loads, an aligned load never crosses a
+ * page so reading past the terminator within the block is safe. The variant
+ * is picked once from the CPU features, other targets use a lookup table.
+ */
+
+#include "priv.h"
+#include <stdint.h>
+
+#define CLASS_SPACE 1
+#define CLASS_DELIMITER 2
+#define CLASS_STRING 4
+
+static const unsigned char CHAR_CLASS[256] = {
+    ['\0'] = CLASS_DELIMITER | CLASS_STRING,
+    [' '] = CLASS_SPACE | CLASS_DELIMITER,
+    ['\t'] = CLASS_SPACE | CLASS_DELIMITER,
+    ['\n'] = CLASS_SPACE | CLASS_DELIMITER,
+    ['\r'] = CLASS_SPACE | CLASS_DELIMITER,
+    ['('] = CLASS_DELIMITER,
+    [')'] = CLASS_DELIMITER,
+    ['['] = CLASS_DELIMITER,
+    [']'] = CLASS_DELIMITER,
+    ['{'] = CLASS_DELIMITER,
+    ['}'] = CLASS_DELIMITER,
+    [';'] = CLASS_DELIMITER,
+    ['"'] = CLASS_STRING,
+    ['\\'] = CLASS_STRING,
+};
+
+static const char* scan_whitespace_scalar(const char* p) {
+    while (CHAR_CLASS[(unsigned char)*p] & CLASS_SPACE)
+        p++;
+    return p;
+}
+
+static const char* scan_delimiter_scalar(const char* p) {
+    while (!(CHAR_CLASS[(unsigned char)*p] & CLASS_DELIMITER))
+        p++;
+    return p;
+}
+
+static const char* scan_string_scalar(const char* p) {
+    while (!(CHAR_CLASS[(unsigned char)*p] & CLASS_STRING))
+        p++;
+    return p;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#    include <immintrin.h>
+
+#    define SCAN_FUNCTION __attribute__((no_sanitize_address)) static const char*
+
+/* the generated masks have one bit per byte that is in the stop set */
+
+static inline unsigned whitespace_mask_sse2(__m128i v) {
+    __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                             _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+    return ~(unsigned)_mm_movemask_epi8(m) & 0xFFFF;
+}
+
+static inline unsigned delimiter_mask_sse2(__m128i v) {
+    __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                             _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+    m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('(')), _mm_cmpeq_epi8(v, _mm_set1_epi8(')'))));
+    m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('[')), _mm_cmpeq_epi8(v, _mm_set1_epi8(']'))));
+    m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('{')), _mm_cmpeq_epi8(v, _mm_set1_epi8('}'))));
+    m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(';')), _mm_cmpeq_epi8(v, _mm_setzero_si128())));
+    return (unsigned)_mm_movemask_epi8(m);
+}
+
+static inline unsigned string_mask_sse2(__m128i v) {
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+    return (unsigned)_mm_movemask_epi8(m);
+}
+
+#    define SCAN_SSE2(name, classify)                                           \
+        SCAN_FUNCTION name(const char* p) {                                     \
+            unsigned offset = (uintptr_t)p & 15;                                \
+            const char* block = p - offset;                                     \
+            unsigned mask = classify(_mm_load_si128((const __m128i*)block));    \
+            mask &= 0xFFFFu << offset;                                          \
+            while (mask == 0) {                                                 \
+                block += 16;                                                    \
+                mask = classify(_mm_load_si128((const __m128i*)block));         \
+            }                                                                   \
+            return block + __builtin_ctz(mask);                                 \
+        }
+
+SCAN_SSE2(scan_whitespace_sse2, whitespace_mask_sse2)
+SCAN_SSE2(scan_delimiter_sse2, delimiter_mask_sse2)
+SCAN_SSE2(scan_string_sse2, string_mask_sse2)
+
+#    define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline unsigned whitespace_mask_avx2(__m256i v) {
+    __m256i m = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+    return ~(unsigned)_mm256_movemask_epi8(m);
+}
+
+AVX2 static inline unsigned delimiter_mask_avx2(__m256i v) {
+    __m256i m = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+    m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('(')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(')'))));
+    m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('[')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(']'))));
+    m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('{')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('}'))));
+    m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(';')), _mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+    return (unsigned)_mm256_movemask_epi8(m);
+}
+
+AVX2 static inline unsigned string_mask_avx2(__m256i v) {
+    __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+    return (unsigned)_mm256_movemask_epi8(m);
+}
+
+#    define SCAN_AVX2(name, classify)                                           \
+        AVX2 SCAN_FUNCTION name(const char* p) {                                \
+            unsigned offset = (uintptr_t)p & 31;                                \
+            const char* block = p - offset;                                     \
+            unsigned mask = classify(_mm256_load_si256((const __m256i*)block)); \
+            mask &= 0xFFFFFFFFu << offset;                                      \
+            while (mask == 0) {                                                 \
+                block += 32;                                                    \
+                mask = classify(_mm256_load_si256((const __m256i*)block));      \
+            }                                                                   \
+            return block + __builtin_ctz(mask);                                 \
+        }
+
+SCAN_AVX2(scan_whitespace_avx2, whitespace_mask_avx2)
+SCAN_AVX2(scan_delimiter_avx2, delimiter_mask_avx2)
+SCAN_AVX2(scan_string_avx2, string_mask_avx2)
+
+#endif
+
+static const char* scan_whitespace_detect(const char* p);
+static const char* scan_delimiter_detect(const char* p);
+static const char* scan_string_detect(const char* p);
+
+static const char* (*scan_whitespace_impl)(const char*) = scan_whitespace_detect;
+static const char* (*scan_delimiter_impl)(const char*) = scan_delimiter_detect;
+static const char* (*scan_string_impl)(const char*) = scan_string_detect;
+
+static void scan_detect() {
+    scan_whitespace_impl = scan_whitespace_scalar;
+    scan_delimiter_impl = scan_delimiter_scalar;
+    scan_string_impl = scan_string_scalar;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_whitespace_impl = scan_whitespace_avx2;
+        scan_delimiter_impl = scan_delimiter_avx2;
+        scan_string_impl = scan_string_avx2;
+    } else {
+        scan_whitespace_impl = scan_whitespace_sse2;
+        scan_delimiter_impl = scan_delimiter_sse2;
+        scan_string_impl = scan_string_sse2;
+    }
+#endif
+}
+
+static const char* scan_whitespace_detect(const char* p) {
+    scan_detect();
+    return scan_whitespace_impl(p);
+}
+
+static const char* scan_delimiter_detect(const char* p) {
+    scan_detect();
+    return scan_delimiter_impl(p);
+}
+
+static const char* scan_string_detect(const char* p) {
+    scan_detect();
+    return scan_string_impl(p);
+}
+
+/* most tokens are short, take a few bytes through the table before going wide */
+
+#define SCAN_PREFIX 8
+
+const char* scan_whitespace(const char* p) {
+    for (int i = 0; i < SCAN_PREFIX; i++, p++)
+        if (!(CHAR_CLASS[(unsigned char)*p] & CLASS_SPACE))
+            return p;
+    return scan_whitespace_impl(p);
+}
+
+const char* scan_delimiter(const char* p) {
+    for (int i = 0; i < SCAN_PREFIX; i++, p++)
+        if (CHAR_CLASS[(unsigned char)*p] & CLASS_DELIMITER)
+            return p;
+    return scan_delimiter_impl(p);
+}
+
+const char* scan_string(const char* p) {
+    for (int i = 0; i < SCAN_PREFIX; i++, p++)
+        if (CHAR_CLASS[(unsigned char)*p] & CLASS_STRING)
+            return p;
+    return scan_string_impl(p);
+}
@@ -0,0 +1,573 @@
+/*
+ * Copyright (c) 2024 Manjeet Singh <itsmanjeet1998@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Cooperative tasks on top of the evaluator's heap frame stack
+ *
+ * A suspended task is just the stack, scope and next expression of an eval
+ * loop, so switching tasks swaps those three values inside the running loop.
+ * A blocking builtin marks the running task as waiting and asks its loop to
+ * switch, the loop then resumes the next runnable task or sleeps in epoll
+ * until a descriptor or timer wakes one up.
+ *
+ * Once a builtin starts a nested evaluation part of the task lives on the C
+ * stack. Blocking in there suspends the nested loop's own evaluation, which
+ * is pinned to that loop and only resumes in it.
+ */
+
+#include "priv.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { TASK_RUNNABLE, TASK_WAITING, TASK_DONE };
+
+struct Task {
+    long id;
+    int status;
+    EvalState* loop; /* loop a suspended nested evaluation resumes in, NULL for spawned tasks */
+    Capsule stack;
+    Capsule scope;
+    Capsule expr;  /* the first call of a spawned task, NIL once started */
+    Capsule value; /* handed over when the task resumes, its result once done */
+    Capsule escapes; /* the loop's escape continuations while the task is switched out */
+    int fd;
+    double deadline;
+    Task* joining;
+    int waiting_all;
+    Task* next;
+    Task* run_next;
+};
+
+static Task* tasks = NULL;
+static Task* run_head = NULL;
+static Task* run_tail = NULL;
+static long task_ids = 0;
+static int active = 0;
+static int fd_waiters = 0;
+static int sleepers = 0;
+static int epoll_fd = -1;
+
+#define MAX_EVENTS 64
+
+void sched_mark() {
+    for (Task* t = tasks; t != NULL; t = t->next) {
+        gc_mark(t->stack);
+        gc_mark(t->scope);
+        gc_mark(t->expr);
+        gc_mark(t->value);
+        gc_mark(t->escapes);
+    }
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static Task* task_new(EvalState* loop) {
+    Task* t = calloc(1, sizeof(Task));
+    if (t == NULL)
+        return NULL;
+
+    t->loop = loop;
+    t->fd = -1;
+    t->deadline = -1;
+    t->next = tasks;
+    tasks = t;
+    return t;
+}
+
+static void task_free(Task* t) {
+    for (Task** p = &tasks; *p != NULL; p = &(*p)->next) {
+        if (*p == t) {
+            *p = t->next;
+            break;
+        }
+    }
+    free(t);
+}
+
+static void make_runnable(Task* t, Capsule value) {
+    t->status = TASK_RUNNABLE;
+    t->value = value;
+    t->run_next = NULL;
+    if (run_tail == NULL)
+        run_head = t;
+    else
+        run_tail->run_next = t;
+    run_tail = t;
+}
+
+static void wake(Task* t, Capsule value) {
+    if (t->status != TASK_WAITING)
+        return;
+
+    if (t->deadline >= 0) {
+        t->deadline = -1;
+        sleepers--;
+    }
+    if (t->fd >= 0) {
+        t->fd = -1;
+        fd_waiters--;
+    }
+    t->joining = NULL;
+    t->waiting_all = 0;
+    make_runnable(t, value);
+}
+
+/* whatever runs in the innermost loop, its own evaluation gets a record the first time it blocks */
+static Task* running() {
+    EvalState* loop = eval_state;
+
+    if (loop == NULL)
+        return NULL;
+    if (loop->task != NULL)
+        return loop->task;
+    if (loop->owner == NULL)
+        loop->owner = task_new(loop);
+    return loop->owner;
+}
+
+/* marks the running task as waiting, its loop switches once the builtin returns */
+static Task* suspend() {
+    Task* t = running();
+
+    if (t != NULL) {
+        t->status = TASK_WAITING;
+        eval_state->suspended = 1;
+    }
+    return t;
+}
+
+static void poll_events() {
+    struct epoll_event events[MAX_EVENTS];
+    int timeout = -1;
+    int count;
+
+    if (sleepers > 0) {
+        double time = now();
+
+        for (Task* t = tasks; t != NULL; t = t->next) {
+            if (t->status != TASK_WAITING || t->deadline < 0)
+                continue;
+            if (t->deadline <= time) {
+                wake(t, Capsule_nil);
+                timeout = 0;
+            } else if (timeout != 0) {
+                int ms = (int)((t->deadline - time) * 1000) + 1;
+                if (timeout < 0 || ms < timeout)
+                    timeout = ms;
+            }
+        }
+    }
+
+    if (epoll_fd < 0 && (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        return;
+
+    count = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+    for (int i = 0; i < count; i++)
+        wake(events[i].data.ptr, CAPSULE_SYMBOL("T"));
+}
+
+/* the first runnable task this loop is able to resume, waits for events while there is none */
+static Task* next(EvalState* loop) {
+    for (;;) {
+        Task *prev = NULL, *t = run_head;
+
+        for (; t != NULL; prev = t, t = t->run_next) {
+            if (t->loop != NULL && t->loop != loop)
+                continue;
+
+            if (prev == NULL)
+                run_head = t->run_next;
+            else
+                prev->run_next = t->run_next;
+            if (run_tail == t)
+                run_tail = prev;
+            return t;
+        }
+
+        if (fd_waiters == 0 && sleepers == 0)
+            return NULL;
+        poll_events();
+    }
+}
+
+static CapsuleError resume(EvalState* loop, Capsule* stack, Capsule* scope, Capsule* expr) {
+    Task* t = next(loop);
+
+    loop->task = NULL;
+    if (t == NULL) {
+        fprintf(stderr, "Deadlock, every task is waiting\n");
+        return CAPSULE_ERROR_RUNTIME;
+    }
+
+    *stack = t->stack;
+    *scope = t->scope;
+    loop->escapes = t->escapes;
+    if (CAPSULE_NILP(t->expr))
+        *expr = CAPSULE_CONS(CAPSULE_SYMBOL("QUOTE"), CAPSULE_CONS(t->value, Capsule_nil));
+    else
+        *expr = t->expr;
+
+    t->stack = t->scope = t->expr = t->value = t->escapes = Capsule_nil;
+    if (t != loop->owner)
+        loop->task = t;
+    return CAPSULE_ERROR_NONE;
+}
+
+CapsuleError sched_switch(EvalState* loop, Capsule* stack, Capsule* scope, Capsule* expr) {
+    Task* t = loop->task != NULL ? loop->task : loop->owner;
+
+    loop->suspended = 0;
+    t->stack = *stack;
+    t->scope = *scope;
+    t->escapes = loop->escapes;
+    return resume(loop, stack, scope, expr);
+}
+
+static void task_done(Task* t, Capsule result) {
+    int joined = 0;
+
+    t->status = TASK_DONE;
+    t->value = result;
+    active--;
+
+    for (Task* u = tasks; u != NULL; u = u->next) {
+        if (u->status == TASK_WAITING && (u->joining == t || (u->waiting_all && active == 0))) {
+            joined |= u->joining == t;
+            wake(u, u->joining == t ? result : Capsule_nil);
+        }
+    }
+
+    /* the result is kept until someone joins the task */
+    if (joined)
+        task_free(t);
+}
+
+CapsuleError sched_finish(EvalState* loop, Capsule* stack, Capsule* scope, Capsule* expr) {
+    task_done(loop->task, *loop->result);
+    return resume(loop, stack, scope, expr);
+}
+
+CapsuleError sched_fail(EvalState* loop, CapsuleError error, Capsule* stack, Capsule* scope, Capsule* expr) {
+    fprintf(stderr, "ERROR: task %ld failed: %s\n", loop->task->id, Capsule_Error_str(error));
+    loop->suspended = 0;
+    escapes_clear(&loop->escapes);
+    task_done(loop->task, Capsule_nil);
+    return resume(loop, stack, scope, expr);
+}
+
+void sched_leave(EvalState* loop) {
+    Task* owner = loop->owner;
+
+    if (owner == NULL)
+        return;
+
+    /* a loop left by an error may still be listed by a channel, keep the record but never wake it */
+    if (owner->status == TASK_WAITING) {
+        if (owner->fd >= 0) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, owner->fd, NULL);
+            fd_waiters--;
+        }
+        if (owner->deadline >= 0)
+            sleepers--;
+        owner->status = TASK_DONE;
+        escapes_clear(&owner->escapes);
+        owner->stack = owner->scope = owner->value = Capsule_nil;
+        return;
+    }
+    task_free(owner);
+}
+
+long sched_spawn(Capsule call, Capsule scope) {
+    Task* t = task_new(NULL);
+    if (t == NULL)
+        return 0;
+
+    t->id = ++task_ids;
+    t->scope = scope;
+    t->expr = call;
+    active++;
+    make_runnable(t, Capsule_nil);
+    return t->id;
+}
+
+CapsuleError sched_join(long id, Capsule* result) {
+    Task *t = tasks, *self;
+
+    while (t != NULL && (t->id != id || t->loop != NULL))
+        t = t->next;
+    if (t == NULL || id == 0)
+        return CAPSULE_ERROR_ARGS;
+
+    if (t->status == TASK_DONE) {
+        *result = t->value;
+        task_free(t);
+        return CAPSULE_ERROR_NONE;
+    }
+
+    if (eval_state != NULL && eval_state->task == t)
+        return CAPSULE_ERROR_ARGS;
+    if ((self = suspend()) == NULL)
+        return CAPSULE_ERROR_RUNTIME;
+    self->joining = t;
+    *result = Capsule_nil;
+    return CAPSULE_ERROR_NONE;
+}
+
+static CapsuleError wait_all(Capsule args, Capsule scope, Capsule* result) {
+    Task* self;
+
+    (void)args;
+    (void)scope;
+    *result = Capsule_nil;
+    if (active == 0)
+        return CAPSULE_ERROR_NONE;
+    if ((self = suspend()) == NULL)
+        return CAPSULE_ERROR_RUNTIME;
+    self->waiting_all = 1;
+    return CAPSULE_ERROR_NONE;
+}
+
+CapsuleError sched_run(Capsule scope) {
+    Capsule result;
+
+    if (active == 0)
+        return CAPSULE_ERROR_NONE;
+    return Capsule_eval_cap(CAPSULE_CONS(CAPSULE_BUILTIN(wait_all), Capsule_nil), scope, &result);
+}
+
+CapsuleError sched_yield(Capsule* result) {
+    Task* self = suspend();
+    if (self == NULL)
+        return CAPSULE_ERROR_RUNTIME;
+
+    make_runnable(self, Capsule_nil);
+    *result = Capsule_nil;
+    return CAPSULE_ERROR_NONE;
+}
+
+CapsuleError sched_sleep(double seconds, Capsule* result) {
+    Task* self = suspend();
+    if (self == NULL)
+        return CAPSULE_ERROR_RUNTIME;
+
+    self->deadline = now() + (seconds > 0 ? seconds : 0);
+    sleepers++;
+    *result = Capsule_nil;
+    return CAPSULE_ERROR_NONE;
+}
+
+size_t stream_pending(FILE* file) {
+#ifdef __GLIBC__
+    if (file->_IO_read_ptr < file->_IO_read_end)
+        return file->_IO_read_end - file->_IO_read_ptr;
+#else
+    (void)file;
+#endif
+    return 0;
+}
+
+/* whether FILE was read or written, stdio sets up its buffer on first use */
+int stream_used(FILE* file) {
+#ifdef __GLIBC__
+    return file->_IO_buf_base != NULL;
+#else
+    (void)file;
+    return 1;
+#endif
+}
+
+CapsuleError sched_await(int fd, int writable, Capsule* result) {
+    struct epoll_event event = {.events = (writable ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT};
+    Task* self;
+
+    for (Task* t = tasks; t != NULL; t = t->next) {
+        if (t->status == TASK_WAITING && t->fd == fd)
+            return CAPSULE_ERROR_RUNTIME;
+    }
+
+    if (epoll_fd < 0 && (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        return CAPSULE_ERROR_RUNTIME;
+
+    if ((self = running()) == NULL)
+        return CAPSULE_ERROR_RUNTIME;
+
+    /* registrations are one shot, a descriptor stays in the set disarmed until it is awaited again */
+    event.data.ptr = self;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0 &&
+        (errno != ENOENT || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)) {
+        /* regular files can not be polled and never block */
+        *result = CAPSULE_SYMBOL("T");
+        return errno == EPERM ? CAPSULE_ERROR_NONE : CAPSULE_ERROR_RUNTIME;
+    }
+
+    suspend();
+    self->fd = fd;
+    fd_waiters++;
+    *result = Capsule_nil;
+    return CAPSULE_ERROR_NONE;
+}
+
+/* (CHANNEL capacity count head tail receivers senders closed), waiting tasks are held as pointers */
+enum { CHANNEL_CAPACITY = 1, CHANNEL_COUNT, CHANNEL_HEAD, CHANNEL_TAIL, CHANNEL_RECEIVERS, CHANNEL_SENDERS, CHANNEL_CLOSED };
+
+Capsule sched_channel(long capacity) {
+    Capsule channel = Capsule_nil;
+
+    for (int i = CHANNEL_CLOSED; i > 0; i--)
+        channel = CAPSULE_CONS(Capsule_nil, channel);
+    channel = CAPSULE_CONS(CAPSULE_SYMBOL("CHANNEL"), channel);
+    Capsule_List_set(channel, CHANNEL_CAPACITY, CAPSULE_INTEGER(capacity));
+    Capsule_List_set(channel, CHANNEL_COUNT, CAPSULE_INTEGER(0));
+    return channel;
+}
+
+int sched_channelp(Capsule channel) {
+    return channel.type == CAPSULE_TYPE_PAIR && CAPSULE_SYMBOL_COMPARE(CAPSULE_CAR(channel), "CHANNEL");
+}
+
+static void channel_set(Capsule channel, int k, Capsule value) {
+    while (k--)
+        channel = CAPSULE_CDR(channel);
+    gc_write_barrier(channel);
+    CAPSULE_CAR(channel) = value;
+}
+
+static void channel_push(Capsule channel, Capsule value) {
+    Capsule cell = CAPSULE_CONS(value, Capsule_nil);
+    Capsule tail = Capsule_List_at(channel, CHANNEL_TAIL);
+
+    if (CAPSULE_NILP(tail)) {
+        channel_set(channel, CHANNEL_HEAD, cell);
+    } else {
+        gc_write_barrier(tail);
+        CAPSULE_CDR(tail) = cell;
+    }
+    channel_set(channel, CHANNEL_TAIL, cell);
+    channel_set(channel, CHANNEL_COUNT, CAPSULE_INTEGER(Capsule_List_at(channel, CHANNEL_COUNT).as.integer + 1));
+}
+
+static Capsule channel_pop(Capsule channel) {
+    Capsule head = Capsule_List_at(channel, CHANNEL_HEAD);
+
+    channel_set(channel, CHANNEL_HEAD, CAPSULE_CDR(head));
+    if (CAPSULE_NILP(CAPSULE_CDR(head)))
+        channel_set(channel, CHANNEL_TAIL, Capsule_nil);
+    channel_set(channel, CHANNEL_COUNT, CAPSULE_INTEGER(Capsule_List_at(channel, CHANNEL_COUNT).as.integer - 1));
+    return CAPSULE_CAR(head);
+}
+
+static void channel_wait(Capsule channel, int k, Capsule entry) {
+    Capsule waiters = Capsule_List_at(channel, k), cell = CAPSULE_CONS(entry, Capsule_nil);
+
+    if (CAPSULE_NILP(waiters)) {
+        channel_set(channel, k, cell);
+        return;
+    }
+    while (!CAPSULE_NILP(CAPSULE_CDR(waiters)))
+        waiters = CAPSULE_CDR(waiters);
+    gc_write_barrier(waiters);
+    CAPSULE_CDR(waiters) = cell;
+}
+
+/* the first waiting receiver, or (task . value) of a waiting sender, NIL when there is none */
+static Capsule channel_waiter(Capsule channel, int k) {
+    Capsule waiters = Capsule_List_at(channel, k);
+
+    while (!CAPSULE_NILP(waiters)) {
+        Capsule entry = CAPSULE_CAR(waiters);
+        Task* t = (k == CHANNEL_SENDERS ? CAPSULE_CAR(entry) : entry).as.pointer;
+
+        waiters = CAPSULE_CDR(waiters);
+        channel_set(channel, k, waiters);
+        if (t->status == TASK_WAITING)
+            return entry;
+    }
+    return Capsule_nil;
+}
+
+CapsuleError sched_send(Capsule channel, Capsule value, Capsule* result) {
+    Capsule receiver;
+    Task* self;
+
+    *result = Capsule_nil;
+    if (!CAPSULE_NILP(Capsule_List_at(channel, CHANNEL_CLOSED)))
+        return CAPSULE_ERROR_NONE;
+
+    *result = CAPSULE_SYMBOL("T");
+    receiver = channel_waiter(channel, CHANNEL_RECEIVERS);
+    if (!CAPSULE_NILP(receiver)) {
+        wake(receiver.as.pointer, value);
+        return CAPSULE_ERROR_NONE;
+    }
+
+    if (Capsule_List_at(channel, CHANNEL_COUNT).as.integer < Capsule_List_at(channel, CHANNEL_CAPACITY).as.integer) {
+        channel_push(channel, value);
+        return CAPSULE_ERROR_NONE;
+    }
+
+    if ((self = suspend()) == NULL)
+        return CAPSULE_ERROR_RUNTIME;
+    channel_wait(channel, CHANNEL_SENDERS, CAPSULE_CONS(CAPSULE_POINTER(self), value));
+    return CAPSULE_ERROR_NONE;
+}
+
+CapsuleError sched_receive(Capsule channel, Capsule* result) {
+    Capsule sender = channel_waiter(channel, CHANNEL_SENDERS);
+    Task* self;
+
+    if (Capsule_List_at(channel, CHANNEL_COUNT).as.integer > 0) {
+        *result = channel_pop(channel);
+        if (!CAPSULE_NILP(sender)) {
+            channel_push(channel, CAPSULE_CDR(sender));
+            wake(CAPSULE_CAR(sender).as.pointer, CAPSULE_SYMBOL("T"));
+        }
+        return CAPSULE_ERROR_NONE;
+    }
+
+    *result = Capsule_nil;
+    if (!CAPSULE_NILP(sender)) {
+        *result = CAPSULE_CDR(sender);
+        wake(CAPSULE_CAR(sender).as.pointer, CAPSULE_SYMBOL("T"));
+        return CAPSULE_ERROR_NONE;
+    }
+
+    if (!CAPSULE_NILP(Capsule_List_at(channel, CHANNEL_CLOSED)))
+        return CAPSULE_ERROR_NONE;
+
+    if ((self = suspend()) == NULL)
+        return CAPSULE_ERROR_RUNTIME;
+    channel_wait(channel, CHANNEL_RECEIVERS, CAPSULE_POINTER(self));
+    return CAPSULE_ERROR_NONE;
+}
+
+void sched_close(Capsule channel) {
+    Capsule waiter;
+
+    channel_set(channel, CHANNEL_CLOSED, CAPSULE_SYMBOL("T"));
+    while (!CAPSULE_NILP(waiter = channel_waiter(channel, CHANNEL_RECEIVERS)))
+        wake(waiter.as.pointer, Capsule_nil);
+    while (!CAPSULE_NILP(waiter = channel_waiter(channel, CHANNEL_SENDERS)))
+        wake(CAPSULE_CAR(waiter).as.pointer, Capsule_nil);
+}
@@ -16,25 +16,55 @@
  */
 
 #include "priv.h"
-#include "runtime.h"
 #include <stdio.h>
 
+#ifdef CAPSULE_BOOTSTRAP
+#    include "runtime.h"
+#else
+#    include "runtime_image.h"
+#endif
+
 static Capsule global_scope = {CAPSULE_TYPE_NIL};
 
+/*
+ * Builtins and the runtime live in their own frozen scope, the collector never
+ * marks or sweeps it. The bootstrap build evaluates runtime.cap, every other
+ * build relocates the image generated from it at build time. User definitions
+ * go into the global scope which is a child of the runtime scope. Mutating a
+ * frozen binding goes through the write barrier.
+ */
 Capsule Capsule_Scope_global() {
     if (CAPSULE_NILP(global_scope)) {
-        Capsule capsule;
+        Capsule runtime_scope = Capsule_nil;
         CapsuleError error;
-        global_scope = Capsule_Scope_new(Capsule_nil);
-        define_builtin(global_scope);
+#ifdef CAPSULE_BOOTSTRAP
+        Capsule capsule;
+        runtime_scope = Capsule_Scope_new(Capsule_nil);
+        define_builtin(runtime_scope);
 
-        if ((error = Capsule_eval(RUNTIME, global_scope, &capsule))) {
+        if ((error = Capsule_eval(RUNTIME, runtime_scope, &capsule))) {
             fprintf(stderr, "ERROR: failed to load runtime, skipping: %s\n", Capsule_Error_str(error));
         }
+
+        gc_freeze(runtime_scope);
+#else
+        if ((error = image_load(RUNTIME_IMAGE, sizeof(RUNTIME_IMAGE), &runtime_scope))) {
+            fprintf(stderr, "ERROR: failed to load runtime image, skipping: %s\n", Capsule_Error_str(error));
+            runtime_scope = Capsule_Scope_new(Capsule_nil);
+            define_builtin(runtime_scope);
+        }
+#endif
+        scope_global_init(runtime_scope);
     }
     return global_scope;
 }
 
+void scope_global_init(Capsule parent) {
+    if (CAPSULE_NILP(global_scope))
+        gc_protect(&global_scope);
+    global_scope = Capsule_Scope_new(parent);
+}
+
 Capsule Capsule_Scope_new(Capsule parent) {
     return CAPSULE_CONS(parent, Capsule_nil);
 }
@@ -45,12 +75,14 @@ int Capsule_Scope_define(Capsule env, Capsule symbol, Capsule value) {
     while (!CAPSULE_NILP(bs)) {
         Capsule b = CAPSULE_CAR(bs);
         if (CAPSULE_CAR(b).as.symbol == symbol.as.symbol) {
+            gc_write_barrier(b);
             CAPSULE_CDR(b) = value;
             return CAPSULE_ERROR_NONE;
         }
         bs = CAPSULE_CDR(bs);
     }
 
+    gc_write_barrier(env);
     CAPSULE_CDR(env) = CAPSULE_CONS(CAPSULE_CONS(symbol, value), CAPSULE_CDR(env));
 
     return CAPSULE_ERROR_NONE;
@@ -60,8 +92,10 @@ int Capsule_Scope_lookup(Capsule env, Capsule symbol, Capsule* result) {
     Capsule parent = CAPSULE_CAR(env);
     Capsule bs = CAPSULE_CDR(env);
 
+    EVAL_COUNT(lookup_scopes);
     while (!CAPSULE_NILP(bs)) {
         Capsule b = CAPSULE_CAR(bs);
+        EVAL_COUNT(lookup_bindings);
         if (CAPSULE_CAR(b).as.symbol == symbol.as.symbol) {
             *result = CAPSULE_CDR(b);
             return CAPSULE_ERROR_NONE;
@@ -82,6 +116,7 @@ int Capsule_Scope_set(Capsule env, Capsule symbol, Capsule value) {
     while (!CAPSULE_NILP(bs)) {
         Capsule b = CAPSULE_CAR(bs);
         if (CAPSULE_CAR(b).as.symbol == symbol.as.symbol) {
+            gc_write_barrier(b);
             CAPSULE_CDR(b) = value;
             return CAPSULE_ERROR_NONE;
         }
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2024 Manjeet Singh <itsmanjeet1998@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Capsule_apply and Capsule_apply_batch with arguments and results on the
+ * heap, held only by the caller's arrays while collections run.
+ */
+
+#include "../src/priv.h"
+#include "capsule.h"
+#include <string.h>
+
+#define TUPLES 3000
+
+static Capsule argv[TUPLES], results[TUPLES];
+
+static int check(int ok, const char* what) {
+    if (!ok)
+        fprintf(stderr, "FAIL: %s\n", what);
+    return ok;
+}
+
+int main() {
+    Capsule scope = Capsule_Scope_global(), pair, result;
+    CapsuleError error;
+    size_t collections;
+    int ok = 1;
+
+    if ((error = Capsule_eval("(define (pair s) (cons s s))", scope, &result)) ||
+        (error = Capsule_Scope_lookup(scope, CAPSULE_SYMBOL("PAIR"), &pair))) {
+        fprintf(stderr, "FAIL: %s\n", Capsule_Error_str(error));
+        return 1;
+    }
+
+    argv[0] = CAPSULE_STRING("single");
+    ok &= check(Capsule_apply(pair, 1, argv, &result) == CAPSULE_ERROR_NONE, "apply");
+    ok &= check(CAPSULE_STRINGP(CAPSULE_CAR(result)) && strcmp(CAPSULE_AS_STRING(CAPSULE_CAR(result)), "single") == 0, "apply result");
+    ok &= check(Capsule_apply(pair, 0, argv, &result) == CAPSULE_ERROR_ARGS, "apply arity");
+
+    /* nothing but these arrays references the strings, collections happen between the calls */
+    for (int i = 0; i < TUPLES; i++)
+        argv[i] = CAPSULE_STRING("hello");
+    collections = runtime_stats.collections;
+    ok &= check(Capsule_apply_batch(pair, TUPLES, 1, argv, results) == CAPSULE_ERROR_NONE, "batch");
+    ok &= check(runtime_stats.collections > collections, "batch collected");
+
+    for (int i = 0; ok && i < TUPLES; i++) {
+        Capsule r = results[i];
+        ok &= check(r.type == CAPSULE_TYPE_PAIR && CAPSULE_AS_STRING(CAPSULE_CAR(r)) == CAPSULE_AS_STRING(argv[i]), "batch result");
+        ok &= check(strcmp(CAPSULE_AS_STRING(CAPSULE_CDR(r)), "hello") == 0, "batch argument");
+    }
+    return ok ? 0 : 1;
+}